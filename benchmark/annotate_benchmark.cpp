@@ -0,0 +1,514 @@
+#include <annotate/annotation_binary.h>
+#include <annotate/annotation_file.h>
+#include <annotate/box_fitter.h>
+#include <annotate/cloud_cache.h>
+#include <annotate/ground_model.h>
+#include <annotate/spatial_index.h>
+#include <annotate/track.h>
+#include <annotate/track_span_index.h>
+#include <annotate/worker_pool.h>
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <map>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace annotate;
+using namespace std;
+
+/**
+ * Synthetic data resembling a labeling session: clouds of a spinning lidar looking at a flat street with parked cars,
+ * boxes around those cars and annotation files with tracks of 100 instances each. All data is generated from fixed
+ * seeds so that runs on different commits measure the same work.
+ */
+namespace
+{
+double const sensor_height = 1.73;
+double const frame_rate = 10.0;
+size_t const instances_per_track = 100;
+
+struct Car
+{
+  tf::Vector3 center;
+  tf::Vector3 size;
+};
+
+struct Lidar
+{
+  int beams;
+  int columns;
+  double lowest_elevation;
+  double highest_elevation;
+};
+
+/// Velodyne HDL-64E and a 128 beam sensor with a symmetric field of view like the Ouster OS1-128
+Lidar lidar(int beams)
+{
+  return beams == 64 ? Lidar{ 64, 2000, -24.8, 2.0 } : Lidar{ 128, 2048, -22.5, 22.5 };
+}
+
+vector<Car> const& cars()
+{
+  static vector<Car> const result = []() {
+    mt19937 random(42);
+    uniform_real_distribution<double> along(-60.0, 60.0);
+    uniform_real_distribution<double> length(3.8, 5.2);
+    uniform_real_distribution<double> width(1.7, 2.0);
+    uniform_real_distribution<double> height(1.4, 1.9);
+    vector<Car> cars;
+    // Two rows of parked cars on either side of the street
+    for (size_t i = 0; i < 100; ++i)
+    {
+      Car car;
+      car.size = tf::Vector3(length(random), width(random), height(random));
+      auto const side = i % 2 ? 6.0 : -6.0;
+      car.center = tf::Vector3(along(random), side, car.size.z() / 2.0);
+      if (car.center.length() > 5.0)
+      {
+        cars.push_back(car);
+      }
+    }
+    return cars;
+  }();
+  return result;
+}
+
+/// Distance along the ray from the sensor at (0, 0, sensor_height) in the given direction to the car, if hit
+bool intersect(const Car& car, const tf::Vector3& direction, double& distance)
+{
+  double near = 0.0;
+  double far = numeric_limits<double>::max();
+  tf::Vector3 const origin(0.0, 0.0, sensor_height);
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    auto const minimum = car.center[axis] - car.size[axis] / 2.0;
+    auto const maximum = car.center[axis] + car.size[axis] / 2.0;
+    if (fabs(direction[axis]) < 1e-12)
+    {
+      if (origin[axis] < minimum || origin[axis] > maximum)
+      {
+        return false;
+      }
+      continue;
+    }
+    auto t1 = (minimum - origin[axis]) / direction[axis];
+    auto t2 = (maximum - origin[axis]) / direction[axis];
+    near = max(near, min(t1, t2));
+    far = min(far, max(t1, t2));
+    if (near > far)
+    {
+      return false;
+    }
+  }
+  distance = near;
+  return true;
+}
+
+CloudCache::Ptr createCloud(int beams)
+{
+  auto const sensor = lidar(beams);
+  double const max_range = 120.0;
+  auto const degrees = M_PI / 180.0;
+  mt19937 random(beams);
+  normal_distribution<double> noise(0.0, 0.01);
+  vector<float> x;
+  vector<float> y;
+  vector<float> z;
+  x.reserve(size_t(sensor.beams) * sensor.columns);
+  y.reserve(x.capacity());
+  z.reserve(x.capacity());
+  for (int column = 0; column < sensor.columns; ++column)
+  {
+    auto const azimuth = 2.0 * M_PI * column / sensor.columns;
+    for (int beam = 0; beam < sensor.beams; ++beam)
+    {
+      auto const elevation =
+          degrees * (sensor.lowest_elevation +
+                     (sensor.highest_elevation - sensor.lowest_elevation) * beam / (sensor.beams - 1.0));
+      tf::Vector3 const direction(cos(elevation) * cos(azimuth), cos(elevation) * sin(azimuth), sin(elevation));
+      auto distance = max_range;
+      if (direction.z() < 0.0)
+      {
+        distance = min(distance, -sensor_height / direction.z());
+      }
+      for (auto const& car : cars())
+      {
+        double hit;
+        if (intersect(car, direction, hit))
+        {
+          distance = min(distance, hit);
+        }
+      }
+      if (distance < max_range)
+      {
+        distance += noise(random);
+        x.push_back(float(direction.x() * distance));
+        y.push_back(float(direction.y() * distance));
+        z.push_back(float(sensor_height + direction.z() * distance));
+      }
+    }
+  }
+  return make_shared<CloudCache const>("velodyne", ros::Time(100, 0), move(x), move(y), move(z));
+}
+
+CloudCache::Ptr const& cloud(int beams)
+{
+  static map<int, CloudCache::Ptr> clouds;
+  auto& result = clouds[beams];
+  if (!result)
+  {
+    result = createCloud(beams);
+  }
+  return result;
+}
+
+SpatialIndex::Ptr const& spatialIndex(int beams)
+{
+  static map<int, SpatialIndex::Ptr> indices;
+  auto& result = indices[beams];
+  if (!result)
+  {
+    result = SpatialIndex::create(SpatialIndex::VoxelHash, *cloud(beams));
+  }
+  return result;
+}
+
+/// Boxes around the first count cars, slightly too small and off-center like a box predicted from a previous frame
+vector<BoxSnapshot> boxes(int beams, size_t count)
+{
+  vector<BoxSnapshot> result;
+  auto const& all = cars();
+  for (size_t i = 0; i < count; ++i)
+  {
+    auto const& car = all[i % all.size()];
+    BoxSnapshot box;
+    box.pose.setIdentity();
+    box.pose.setOrigin(car.center + tf::Vector3(0.2, -0.1, 0.0));
+    box.size = car.size * 0.8;
+    box.cloud_transform.setIdentity();
+    box.cloud = cloud(beams);
+    box.index = spatialIndex(beams);
+    result.push_back(box);
+  }
+  return result;
+}
+
+AnnotationData annotations(size_t instances)
+{
+  mt19937 random(instances);
+  uniform_real_distribution<double> position(-50.0, 50.0);
+  uniform_real_distribution<double> yaw(-M_PI, M_PI);
+  AnnotationData data;
+  data.labels = { "car", "pedestrian", "cyclist" };
+  auto const tracks = max<size_t>(1, instances / instances_per_track);
+  // Tracks start one after another, about five of them overlap at any time
+  auto const track_offset = instances_per_track / frame_rate / 5.0;
+  for (size_t id = 0; id < tracks; ++id)
+  {
+    AnnotationTrack track;
+    track.id = id;
+    track.track.reserve(instances_per_track);
+    tf::Vector3 const start(position(random), position(random), 0.8);
+    auto const heading = yaw(random);
+    for (size_t i = 0; i < min(instances, instances_per_track); ++i)
+    {
+      TrackInstance instance;
+      instance.label = data.labels[id % data.labels.size()];
+      auto const time = 1.0 + id * track_offset + i / frame_rate;
+      instance.center.stamp_ = ros::Time(uint32_t(time), uint32_t((time - floor(time)) * 1e9));
+      instance.center.frame_id_ = "odom";
+      instance.center.child_frame_id_ = "track_" + to_string(id);
+      instance.center.setOrigin(start + tf::Vector3(cos(heading), sin(heading), 0.0) * (0.5 * i / frame_rate));
+      tf::Quaternion rotation;
+      rotation.setRPY(0.0, 0.0, heading);
+      instance.center.setRotation(rotation);
+      instance.box_size = tf::Vector3(4.5, 1.8, 1.6);
+      track.track.insert(instance);
+    }
+    data.tracks.push_back(track);
+  }
+  return data;
+}
+
+AnnotationData const& cachedAnnotations(size_t instances)
+{
+  static map<size_t, AnnotationData> cache;
+  auto entry = cache.find(instances);
+  if (entry == cache.end())
+  {
+    entry = cache.emplace(instances, annotations(instances)).first;
+  }
+  return entry->second;
+}
+
+ros::Time sessionEnd(const AnnotationData& data)
+{
+  ros::Time end;
+  for (auto const& track : data.tracks)
+  {
+    end = max(end, track.track.back().center.stamp_);
+  }
+  return end;
+}
+
+string temporaryFile(const string& extension)
+{
+  return "/tmp/annotate_benchmark_" + to_string(getpid()) + extension;
+}
+
+/// Both lidars with 1, 10, ... up to max_markers markers
+template <int max_markers>
+void markerArguments(benchmark::internal::Benchmark* benchmark)
+{
+  for (auto const beams : { 64, 128 })
+  {
+    for (int markers = 1; markers <= max_markers; markers *= 10)
+    {
+      benchmark->Args({ beams, markers });
+    }
+  }
+}
+
+void setCloudCounters(benchmark::State& state, int beams)
+{
+  state.counters["points"] = double(cloud(beams)->size());
+}
+
+}  // namespace
+
+static void BM_IndexCloud(benchmark::State& state)
+{
+  auto const beams = int(state.range(0));
+  auto const type = SpatialIndex::Type(state.range(1));
+  auto const& points = *cloud(beams);
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(SpatialIndex::create(type, points));
+  }
+  setCloudCounters(state, beams);
+}
+BENCHMARK(BM_IndexCloud)
+    ->Args({ 64, SpatialIndex::VoxelHash })
+    ->Args({ 64, SpatialIndex::KdTree })
+    ->Args({ 128, SpatialIndex::VoxelHash })
+    ->Args({ 128, SpatialIndex::KdTree })
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_GroundModel(benchmark::State& state)
+{
+  auto const beams = int(state.range(0));
+  auto const& points = *cloud(beams);
+  for (auto _ : state)
+  {
+    GroundModel ground(points);
+    benchmark::DoNotOptimize(ground.objects());
+  }
+  setCloudCounters(state, beams);
+}
+BENCHMARK(BM_GroundModel)->Arg(64)->Arg(128)->Unit(benchmark::kMillisecond);
+
+static void BM_AnalyzePoints(benchmark::State& state)
+{
+  auto const beams = int(state.range(0));
+  auto const markers = boxes(beams, size_t(state.range(1)));
+  for (auto _ : state)
+  {
+    for (auto const& box : markers)
+    {
+      benchmark::DoNotOptimize(analyzePoints(box));
+    }
+  }
+  setCloudCounters(state, beams);
+  state.SetItemsProcessed(int64_t(state.iterations() * markers.size()));
+}
+BENCHMARK(BM_AnalyzePoints)->Apply(markerArguments<100>)->Unit(benchmark::kMicrosecond);
+
+static void BM_FitNearbyPoints(benchmark::State& state)
+{
+  auto const beams = int(state.range(0));
+  auto const markers = boxes(beams, size_t(state.range(1)));
+  string error;
+  for (auto _ : state)
+  {
+    for (auto box : markers)
+    {
+      benchmark::DoNotOptimize(fitNearbyPoints(box, error));
+    }
+  }
+  setCloudCounters(state, beams);
+  state.SetItemsProcessed(int64_t(state.iterations() * markers.size()));
+}
+BENCHMARK(BM_FitNearbyPoints)->Apply(markerArguments<10>)->Unit(benchmark::kMicrosecond);
+
+static void BM_FitOrientation(benchmark::State& state)
+{
+  auto const beams = int(state.range(0));
+  auto const markers = boxes(beams, size_t(state.range(1)));
+  string error;
+  for (auto _ : state)
+  {
+    for (auto box : markers)
+    {
+      benchmark::DoNotOptimize(fitOrientation(box, 0.0, error));
+    }
+  }
+  setCloudCounters(state, beams);
+  state.SetItemsProcessed(int64_t(state.iterations() * markers.size()));
+}
+BENCHMARK(BM_FitOrientation)->Apply(markerArguments<10>)->Unit(benchmark::kMicrosecond);
+
+/**
+ * What AnnotateDisplay::handlePointcloud does for each new cloud apart from rviz: look up the instance of every
+ * marker at the new time and count the points in its box, in parallel on the worker pool.
+ */
+static void BM_SetTime(benchmark::State& state)
+{
+  auto const beams = int(state.range(0));
+  auto const markers = size_t(state.range(1));
+  auto const& data = cachedAnnotations(markers * instances_per_track);
+  auto snapshots = boxes(beams, markers);
+  WorkerPool pool;
+  vector<PointContext> contexts(markers);
+  auto time = data.tracks.front().track.front().center.stamp_;
+  for (auto _ : state)
+  {
+    pool.parallelFor(markers, [&](size_t i) {
+      auto const& track = data.tracks[i % data.tracks.size()].track;
+      auto const* instance = track.find(time, 0.05);
+      if (!instance)
+      {
+        const TrackInstance* second;
+        track.nearest(time, instance, second);
+      }
+      contexts[i] = analyzePoints(snapshots[i]);
+    });
+    benchmark::DoNotOptimize(contexts.data());
+  }
+  setCloudCounters(state, beams);
+  state.SetItemsProcessed(int64_t(state.iterations() * markers));
+}
+BENCHMARK(BM_SetTime)->Apply(markerArguments<100>)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+/**
+ * The track lookup of AnnotateDisplay::publishTrackMarkers: find the tracks with instances in the five seconds before
+ * the current time and the instances of their paths.
+ */
+static void BM_TrackWindow(benchmark::State& state)
+{
+  auto const& data = cachedAnnotations(size_t(state.range(0)));
+  TrackSpanIndex spans;
+  for (auto const& track : data.tracks)
+  {
+    spans.insert(int(track.id), track.track.front().center.stamp_.toSec(), track.track.back().center.stamp_.toSec());
+  }
+  spans.build();
+  auto const end = sessionEnd(data).toSec();
+  double const window = 5.0;
+  vector<int> ids;
+  size_t step = 0;
+  for (auto _ : state)
+  {
+    // Walk through the session like playback does
+    auto const time = 1.0 + fmod(step++ / frame_rate, end);
+    ids.clear();
+    spans.query(time - window, time, ids);
+    size_t instances = 0;
+    for (auto const id : ids)
+    {
+      auto const range = data.tracks[size_t(id)].track.range(ros::Time(time - window), ros::Time(time));
+      instances += size_t(range.second - range.first);
+    }
+    benchmark::DoNotOptimize(instances);
+  }
+}
+BENCHMARK(BM_TrackWindow)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMicrosecond);
+
+static void BM_WriteYaml(benchmark::State& state)
+{
+  auto const& data = cachedAnnotations(size_t(state.range(0)));
+  auto const file = temporaryFile(".yaml");
+  string error;
+  for (auto _ : state)
+  {
+    if (!writeYaml(file, data, error))
+    {
+      state.SkipWithError(error.c_str());
+      break;
+    }
+  }
+  remove(file.c_str());
+  state.SetItemsProcessed(int64_t(state.iterations() * state.range(0)));
+}
+BENCHMARK(BM_WriteYaml)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond);
+
+static void BM_ReadYaml(benchmark::State& state)
+{
+  auto const file = temporaryFile(".yaml");
+  string error;
+  if (!writeYaml(file, cachedAnnotations(size_t(state.range(0))), error))
+  {
+    state.SkipWithError(error.c_str());
+    return;
+  }
+  WorkerPool pool;
+  for (auto _ : state)
+  {
+    AnnotationData data;
+    if (!readYaml(file, data, error, pool, [](double) {}))
+    {
+      state.SkipWithError(error.c_str());
+      break;
+    }
+  }
+  remove(file.c_str());
+  state.SetItemsProcessed(int64_t(state.iterations() * state.range(0)));
+}
+BENCHMARK(BM_ReadYaml)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_WriteBinary(benchmark::State& state)
+{
+  auto const& data = cachedAnnotations(size_t(state.range(0)));
+  auto const file = temporaryFile(".annotate");
+  string error;
+  for (auto _ : state)
+  {
+    if (!writeBinary(file, data, error))
+    {
+      state.SkipWithError(error.c_str());
+      break;
+    }
+  }
+  remove(file.c_str());
+  state.SetItemsProcessed(int64_t(state.iterations() * state.range(0)));
+}
+BENCHMARK(BM_WriteBinary)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond);
+
+static void BM_ReadBinary(benchmark::State& state)
+{
+  auto const file = temporaryFile(".annotate");
+  string error;
+  if (!writeBinary(file, cachedAnnotations(size_t(state.range(0))), error))
+  {
+    state.SkipWithError(error.c_str());
+    return;
+  }
+  for (auto _ : state)
+  {
+    AnnotationData data;
+    if (!readBinary(file, data, error))
+    {
+      state.SkipWithError(error.c_str());
+      break;
+    }
+  }
+  remove(file.c_str());
+  state.SetItemsProcessed(int64_t(state.iterations() * state.range(0)));
+}
+BENCHMARK(BM_ReadBinary)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
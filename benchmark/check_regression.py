@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+Run the annotate benchmarks and compare their timings against a stored baseline.
+
+Fails if a benchmark got slower than the baseline by more than the given threshold. Benchmarks missing in either the
+results or the baseline are reported but do not fail the check. Use --update to record the current results as the
+new baseline, for example after an intended change or on a new machine. Without a baseline, the check exits with
+code 77, which ctest reports as skipped.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+# Exit code for a missing baseline, registered as SKIP_RETURN_CODE of the ctest
+MISSING_BASELINE = 77
+
+
+def run_benchmarks(executable, benchmark_filter, min_time):
+    handle, output = tempfile.mkstemp(suffix='.json')
+    os.close(handle)
+    try:
+        command = [executable, '--benchmark_out=' + output, '--benchmark_out_format=json']
+        if benchmark_filter:
+            command.append('--benchmark_filter=' + benchmark_filter)
+        if min_time:
+            command.append('--benchmark_min_time=' + str(min_time))
+        subprocess.check_call(command)
+        with open(output) as results:
+            return json.load(results)
+    finally:
+        os.remove(output)
+
+
+def timings(results):
+    """Real time per iteration in nanoseconds by benchmark name"""
+    scale = {'ns': 1.0, 'us': 1e3, 'ms': 1e6, 's': 1e9}
+    result = {}
+    for benchmark in results.get('benchmarks', []):
+        if benchmark.get('run_type', 'iteration') != 'iteration' or 'error_occurred' in benchmark:
+            continue
+        result[benchmark['name']] = benchmark['real_time'] * scale[benchmark.get('time_unit', 'ns')]
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('executable', help='benchmark executable')
+    parser.add_argument('baseline', help='JSON output of a previous benchmark run')
+    parser.add_argument('--threshold', type=float, default=0.1,
+                        help='allowed slowdown relative to the baseline (default: %(default)s)')
+    parser.add_argument('--filter', default='', help='only run benchmarks matching this regular expression')
+    parser.add_argument('--min-time', type=float, default=0.0, help='minimum time per benchmark in seconds')
+    parser.add_argument('--output', help='also write the results of this run to the given file')
+    parser.add_argument('--update', action='store_true', help='store the results as the new baseline')
+    arguments = parser.parse_args()
+
+    if not arguments.update and not os.path.exists(arguments.baseline):
+        print('No benchmark baseline at {}, record one with --update'.format(arguments.baseline))
+        return MISSING_BASELINE
+
+    results = run_benchmarks(arguments.executable, arguments.filter, arguments.min_time)
+    if arguments.output:
+        with open(arguments.output, 'w') as output:
+            json.dump(results, output, indent=2)
+    if arguments.update:
+        with open(arguments.baseline, 'w') as baseline:
+            json.dump(results, baseline, indent=2)
+        print('Stored {} results as baseline {}'.format(len(timings(results)), arguments.baseline))
+        return 0
+
+    with open(arguments.baseline) as baseline:
+        expected = timings(json.load(baseline))
+    current = timings(results)
+
+    regressions = []
+    for name in sorted(current):
+        if name not in expected:
+            print('{:<50} {:>12.0f} ns  (not in baseline)'.format(name, current[name]))
+            continue
+        change = current[name] / expected[name] - 1.0
+        marker = ''
+        if change > arguments.threshold:
+            regressions.append(name)
+            marker = '  REGRESSION'
+        print('{:<50} {:>12.0f} ns  {:>+7.1%}{}'.format(name, current[name], change, marker))
+    for name in sorted(set(expected) - set(current)) if not arguments.filter else []:
+        print('{:<50} missing in results'.format(name))
+
+    if regressions:
+        print('{} of {} benchmarks are more than {:.0%} slower than the baseline'.format(
+            len(regressions), len(current), arguments.threshold))
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -1,6 +1,18 @@
 #pragma once
 
+#include "annotation_binary.h"
+#include "annotation_file.h"
+#include "annotation_journal.h"
 #include "annotation_marker.h"
+#include "bag_reader.h"
+#include "cloud_cache.h"
+#include "ground_model.h"
+#include "latency_monitor.h"
+#include "spatial_index.h"
+#include "trace_recorder.h"
+#include "track_span_index.h"
+#include "update_batcher.h"
+#include "worker_pool.h"
 #include "file_dialog_property.h"
 #include "shortcut_property.h"
 #include <ros/ros.h>
@@ -11,16 +23,29 @@
 #include <interactive_markers/menu_handler.h>
 #include <memory>
 #include <stack>
+#include <tuple>
 #include <sensor_msgs/PointCloud2.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <visualization_msgs/MarkerArray.h>
 #include <tf/transform_broadcaster.h>
 #include <tf/transform_listener.h>
+#include <tf2_msgs/TFMessage.h>
 #include <QTime>
+#include <QTimer>
 #include <limits>
+#include <map>
 #include <rviz/display_group.h>
 #include <rviz/properties/string_property.h>
 #include <rviz/properties/bool_property.h>
+#include <rviz/properties/enum_property.h>
+#include <rviz/properties/float_property.h>
+#include <rviz/properties/int_property.h>
 #include <rviz/properties/ros_topic_property.h>
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <future>
+#include <mutex>
 
 namespace annotate
 {
@@ -33,26 +58,91 @@ class AnnotateDisplay : public rviz::DisplayGroup
   Q_OBJECT
 public:
   AnnotateDisplay();
+  ~AnnotateDisplay() override;
   void onInitialize() override;
   void setTopic(const QString& topic, const QString& datatype) override;
   void load(const rviz::Config& config) override;
   void setCurrentMarker(AnnotationMarker* marker);
 
   bool save();
+
+  /**
+   * Persist a committed instance of the given track. The instance is appended to the annotation journal; the
+   * annotation file itself is rewritten in the background from time to time.
+   */
+  bool saveInstance(int id, const TrackInstance& instance);
   void publishTrackMarkers();
+  void scheduleServerUpdate();
+
+  /**
+   * Compute fit on the worker pool. The result is handed to the marker it belongs to on the GUI thread.
+   */
+  void fitInBackground(std::function<AnnotationMarker::FitResult()> fit);
   sensor_msgs::PointCloud2ConstPtr cloud() const;
+  CloudCache::Ptr cloudCache() const;
+  SpatialIndex::Ptr spatialIndex() const;
+
+  /**
+   * Ground of the current cloud if "Ignore Ground" is enabled. The spatial index then only contains the points
+   * above the ground.
+   */
+  GroundModel::Ptr groundModel() const;
   tf::TransformListener& transformListener();
 
+  /**
+   * Transform from the current cloud into frame at time, or at the cloud time if that is earlier. Never waits for tf:
+   * if the transform is not available yet, false is returned and the marker with the given id is re-evaluated once
+   * it arrives. Without data after a short while, the latest available transform is used instead.
+   */
+  bool cloudTransform(int marker_id, const std::string& frame, const ros::Time& time, tf::StampedTransform& transform);
+
+  /**
+   * Lookups of cloudTransform() answered from the per-frame transform cache and those that had to query tf
+   */
+  size_t transformCacheHits() const;
+  size_t transformCacheMisses() const;
+
+  /**
+   * Latency statistics of the hot paths, recording only while "Latency Statistics" is enabled
+   */
+  LatencyMonitor& latencyMonitor();
+
+  /**
+   * Timeline of the GUI thread handlers, recording only while "Tracing" is enabled
+   */
+  TraceRecorder& traceRecorder();
+
   bool shrinkAfterResize() const;
   bool shrinkBeforeCommit() const;
   bool autoFitAfterPredict() const;
+  bool autoFitOrientation() const;
 
 private Q_SLOTS:
   void updateTopic();
+  void openBag();
+  void updateBagFrame();
+  void previousFrame();
+  void nextFrame();
+  void playBag();
   void updateLabels();
   void openFile();
   void updateAnnotationFile();
   void updateIgnoreGround();
+  void updateSpatialIndex();
+  void updateMarkerUpdateRate();
+  void updateLatencyStatistics();
+  void publishLatencyStatistics();
+  void updateTracing();
+  void writeTrace();
+  void updateJournalSync();
+  void syncJournal();
+  void compactJournal();
+  void finishCompaction();
+  void updateLoadProgress(int percent);
+  void finishLoading();
+  void finishPointcloud();
+  void processPendingTransforms();
+  void applyFitResults();
   void autoFitPoints();
   void undo();
   void commit();
@@ -62,6 +152,44 @@ private Q_SLOTS:
   void updateShortcuts();
 
 private:
+  struct PublishedPath
+  {
+    ros::Time first;
+    ros::Time last;
+    size_t size{ 0 };
+    size_t revision{ 0 };
+
+    bool operator==(const PublishedPath& other) const
+    {
+      return first == other.first && last == other.last && size == other.size && revision == other.revision;
+    }
+  };
+
+  struct PendingTransform
+  {
+    std::string frame;
+    ros::Time stamp;
+    std::chrono::steady_clock::time_point requested;
+  };
+
+  struct LoadedFile
+  {
+    std::string file;
+    AnnotationData data;
+    std::shared_ptr<BinaryAnnotationFile> binary;
+    std::map<int, size_t> lazy_tracks;
+    size_t replayed{ 0 };
+    bool success{ false };
+    std::string error;
+  };
+
+  struct IndexedCloud
+  {
+    size_t generation{ 0 };
+    SpatialIndex::Ptr index;
+    GroundModel::Ptr ground;
+  };
+
   enum PlaybackCommand
   {
     Play,
@@ -72,27 +200,87 @@ private:
   template <class T>
   void modifyChild(rviz::Property* parent, QString const& name, std::function<void(T*)> modifier);
   void adjustView();
-  bool load(std::string const& file);
+  void load(std::string const& file);
+  void syncJournalLater();
+  AnnotationData annotationData() const;
   void createNewAnnotation(const geometry_msgs::PointStamped::ConstPtr& message);
   void handlePointcloud(const sensor_msgs::PointCloud2ConstPtr& cloud);
+  void updateActiveMarkers();
+  void resendTrackMarkers(const ros::SingleSubscriberPublisher& publisher);
+  const TrackSpanIndex& trackSpans();
+  Track& track(int id);
   void sendPlaybackCommand(PlaybackCommand command);
+  void showBagFrame(size_t frame);
+  void feedBagTransforms(const ros::Time& time);
+  void feedTransforms(const BagReader::Entry& entry, bool is_static);
+  void notifyTransformsChanged();
+  int64_t currentMarkerId() const;
 
   ros::NodeHandle node_handle_;
   ros::Subscriber new_annotation_subscriber_;
   ros::Subscriber pointcloud_subscriber_;
   ros::Publisher track_marker_publisher_;
+  visualization_msgs::MarkerArray track_message_;
+  /// Markers not needed by the last track message, kept for the memory of their points
+  std::vector<visualization_msgs::Marker> spare_track_markers_;
+  std::map<int, PublishedPath> published_paths_;
+  std::map<int, size_t> track_revisions_;
+  bool resend_track_markers_{ true };
   std::shared_ptr<interactive_markers::InteractiveMarkerServer> server_;
+  UpdateBatcher* update_batcher_{ nullptr };
   size_t current_marker_id_{ 0 };
-  std::vector<AnnotationMarker::Ptr> markers_;
+  std::map<int, Track> tracks_;
+  /// Binary annotation file the tracks were loaded from. Its tracks are decoded when first needed.
+  std::shared_ptr<BinaryAnnotationFile> binary_file_;
+  /// Tracks of binary_file_ not decoded into tracks_ yet, with their index in the file
+  std::map<int, size_t> lazy_tracks_;
+  TrackSpanIndex track_spans_;
+  bool track_spans_valid_{ false };
+  std::map<int, AnnotationMarker::Ptr> markers_;
+  LatencyMonitor latency_monitor_;
+  QTimer* latency_timer_{ nullptr };
+  ros::Publisher diagnostics_publisher_;
+  TraceRecorder trace_recorder_;
+  std::mutex fit_results_mutex_;
+  std::vector<AnnotationMarker::FitResult> fit_results_;
+  /// Number of clouds handled so far. Spatial indices of older clouds are dropped.
+  size_t cloud_generation_{ 0 };
+  std::mutex indexed_cloud_mutex_;
+  IndexedCloud indexed_cloud_;
+  /// Markers that switched to the time of the latest cloud and wait for its spatial index
+  std::vector<int> indexing_markers_;
+  WorkerPool worker_pool_;
   std::vector<std::string> labels_;
   std::string filename_;
+  AnnotationJournal journal_;
+  QTimer* journal_sync_timer_{ nullptr };
+  QTimer* compaction_timer_{ nullptr };
+  std::future<std::string> compaction_;
+  std::future<LoadedFile> loading_;
   ros::Time time_;
   ros::Time last_track_publish_time_;
   sensor_msgs::PointCloud2ConstPtr cloud_;
+  CloudCache::Ptr cloud_cache_;
+  SpatialIndex::Ptr spatial_index_;
+  GroundModel::Ptr ground_model_;
   tf::TransformListener transform_listener_;
+  boost::signals2::connection transforms_changed_connection_;
+  std::map<int, PendingTransform> pending_transforms_;
+  std::map<std::tuple<std::string, std::string, ros::Time>, tf::StampedTransform> transform_cache_;
+  size_t transform_cache_hits_{ 0 };
+  size_t transform_cache_misses_{ 0 };
+  QTimer* pending_transform_timer_{ nullptr };
+  std::atomic<bool> waiting_for_transforms_{ false };
+  std::atomic<bool> transforms_changed_{ false };
   bool ignore_ground_{ false };
   rviz::RosTopicProperty* topic_property_{ nullptr };
   rviz::BoolProperty* ignore_ground_property_{ nullptr };
+  rviz::EnumProperty* spatial_index_property_{ nullptr };
+  rviz::FloatProperty* marker_update_rate_property_{ nullptr };
+  rviz::EnumProperty* journal_sync_property_{ nullptr };
+  rviz::BoolProperty* latency_statistics_property_{ nullptr };
+  rviz::BoolProperty* tracing_property_{ nullptr };
+  FileDialogProperty* trace_file_property_{ nullptr };
   rviz::StringProperty* labels_property_{ nullptr };
   FileDialogProperty* open_file_property_{ nullptr };
   FileDialogProperty* annotation_file_property_{ nullptr };
@@ -102,9 +290,22 @@ private:
   AnnotationMarker* current_marker_{ nullptr };
   BoolProperty* shortcuts_property_{ nullptr };
   ros::ServiceClient playback_client_;
+  BagReader bag_;
+  std::vector<BagReader::Entry> bag_clouds_;
+  std::vector<BagReader::Entry> bag_transforms_;
+  std::vector<BagReader::Entry> bag_static_transforms_;
+  size_t bag_frame_{ 0 };
+  /// Range of bag_transforms_ passed to the transform listener since it was last cleared
+  size_t bag_transforms_begin_{ 0 };
+  size_t bag_transforms_end_{ 0 };
+  ros::Publisher bag_cloud_publisher_;
+  QTimer* bag_playback_timer_{ nullptr };
+  FileDialogProperty* bag_file_property_{ nullptr };
+  rviz::IntProperty* bag_frame_property_{ nullptr };
   BoolProperty* shrink_after_resize_{ nullptr };
   BoolProperty* shrink_before_commit_{ nullptr };
   BoolProperty* auto_fit_after_predict_{ nullptr };
+  BoolProperty* auto_fit_orientation_{ nullptr };
   BoolProperty* play_after_commit_{ nullptr };
   BoolProperty* pause_after_data_change_{ nullptr };
 };
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "annotation_file.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace annotate
+{
+/**
+ * Read-only view of a binary annotation file. The file is memory-mapped and stores each property of all track
+ * instances in a separate column, so opening it costs the same regardless of its size and instances are only
+ * decoded when accessed. Instances are grouped by track and ordered by time within each track. An additional time
+ * index lists all instances in order of time. Files are stored in host byte order; files of a different byte order
+ * are rejected.
+ */
+class BinaryAnnotationFile
+{
+public:
+  struct TrackSpan
+  {
+    uint64_t id;
+    uint64_t begin;
+    uint64_t end;
+  };
+
+  BinaryAnnotationFile() = default;
+  ~BinaryAnnotationFile();
+
+  BinaryAnnotationFile(const BinaryAnnotationFile&) = delete;
+  BinaryAnnotationFile& operator=(const BinaryAnnotationFile&) = delete;
+
+  bool open(const std::string& file, std::string& error);
+  void close();
+  bool isOpen() const;
+
+  std::vector<std::string> labels() const;
+
+  size_t tracks() const;
+  const TrackSpan& track(size_t index) const;
+  Track trackInstances(size_t index) const;
+
+  size_t instances() const;
+  TrackInstance instance(size_t index) const;
+  ros::Time stamp(size_t index) const;
+  uint64_t trackId(size_t index) const;
+
+  /**
+   * Indices of all instances with a time stamp in [begin, end] in order of time
+   */
+  void query(const ros::Time& begin, const ros::Time& end, std::vector<uint64_t>& instances) const;
+
+private:
+  template <class T>
+  const T* column(size_t section) const;
+  std::string text(size_t section, size_t index) const;
+  size_t texts(size_t section) const;
+
+  void* mapping_{ nullptr };
+  size_t size_{ 0 };
+  size_t instances_{ 0 };
+  size_t tracks_{ 0 };
+};
+
+bool readBinary(const std::string& file, AnnotationData& data, std::string& error);
+
+/**
+ * Write data to file in the binary annotation format. The file is replaced atomically.
+ */
+bool writeBinary(const std::string& file, const AnnotationData& data, std::string& error);
+
+}  // namespace annotate
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "track.h"
+#include "worker_pool.h"
+#include <yaml-cpp/yaml.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace annotate
+{
+struct AnnotationTrack
+{
+  size_t id{ 0 };
+  Track track;
+};
+
+/**
+ * Contents of an annotation file: the available labels and all annotated tracks
+ */
+struct AnnotationData
+{
+  std::vector<std::string> labels;
+  std::vector<AnnotationTrack> tracks;
+
+  size_t annotations() const;
+
+  /**
+   * Insert instance into the track with the given id, replacing an existing instance with the same time stamp.
+   * Creates the track if needed.
+   */
+  void insert(size_t id, const TrackInstance& instance);
+};
+
+YAML::Node toYaml(const TrackInstance& instance);
+TrackInstance trackInstanceFromYaml(const YAML::Node& node);
+
+bool readYaml(const std::string& file, AnnotationData& data, std::string& error);
+
+/**
+ * Read file while splitting its tracks into chunks that are parsed concurrently by pool. Progress is reported as a
+ * fraction in [0, 1] from arbitrary threads. Falls back to reading sequentially for layouts other than the block
+ * style written by writeYaml.
+ */
+bool readYaml(const std::string& file, AnnotationData& data, std::string& error, WorkerPool& pool,
+              const std::function<void(double)>& progress);
+
+/**
+ * Write data to file. The file is replaced atomically such that readers and crashes never see partial content.
+ */
+bool writeYaml(const std::string& file, const AnnotationData& data, std::string& error);
+
+/**
+ * Files with the .annotate extension use the binary annotation format, all others YAML
+ */
+bool isBinaryAnnotationFile(const std::string& file);
+bool readAnnotations(const std::string& file, AnnotationData& data, std::string& error);
+bool readAnnotations(const std::string& file, AnnotationData& data, std::string& error, WorkerPool& pool,
+                     const std::function<void(double)>& progress);
+bool writeAnnotations(const std::string& file, const AnnotationData& data, std::string& error);
+
+/**
+ * Replace file by the completely written temporary_file such that it survives a power loss: the data of
+ * temporary_file is flushed to disk before renaming it, the directory entry afterwards. temporary_file is removed
+ * on failure.
+ */
+bool replaceFile(const std::string& temporary_file, const std::string& file);
+
+}  // namespace annotate
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "annotation_file.h"
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace annotate
+{
+/**
+ * Append-only log of annotation changes stored next to an annotation file. Each commit appends a single record
+ * instead of rewriting the annotation file. Compaction folds the journal into the annotation file: rotate() moves
+ * the records written so far aside, and once the annotation file contains them, removeRotated() deletes them.
+ * Records are idempotent, so replaying a journal on top of an annotation file that already contains some of them
+ * is harmless.
+ */
+class AnnotationJournal
+{
+public:
+  enum SyncPolicy
+  {
+    SyncEveryRecord,
+    SyncPeriodically,
+    SyncNever
+  };
+
+  AnnotationJournal() = default;
+  ~AnnotationJournal();
+
+  AnnotationJournal(const AnnotationJournal&) = delete;
+  AnnotationJournal& operator=(const AnnotationJournal&) = delete;
+
+  /**
+   * Open the journal of the given annotation file for appending. Existing records are discarded if truncate is set.
+   */
+  bool open(const std::string& annotation_file, bool truncate);
+  void close();
+  bool isOpen() const;
+  void setSyncPolicy(SyncPolicy policy);
+
+  bool append(size_t id, const TrackInstance& instance);
+  bool appendLabels(const std::vector<std::string>& labels);
+  void sync();
+
+  /**
+   * True if records were appended since the last sync. With SyncPeriodically, records are only synced when another
+   * one is appended later, so callers should sync() them after a while.
+   */
+  bool unsynced() const;
+
+  /**
+   * Number of records in the current journal, i.e. those not yet handed to a compaction
+   */
+  size_t records() const;
+
+  bool rotate();
+  void removeRotated();
+
+  /**
+   * Apply the records of the rotated and the current journal of annotation_file to data. Returns the number of
+   * records applied. Incomplete records at the end of a journal (e.g. after a crash) are ignored.
+   */
+  static size_t replay(const std::string& annotation_file, AnnotationData& data);
+
+  static std::string journalFile(const std::string& annotation_file);
+  static std::string rotatedFile(const std::string& annotation_file);
+
+private:
+  bool write(const YAML::Node& record);
+  static size_t replayFile(const std::string& file, AnnotationData& data);
+
+  std::string annotation_file_;
+  int descriptor_{ -1 };
+  size_t records_{ 0 };
+  SyncPolicy sync_policy_{ SyncPeriodically };
+  std::chrono::steady_clock::time_point last_sync_;
+  bool unsynced_{ false };
+};
+
+}  // namespace annotate
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "annotation_marker.h"
+#include "box_fitter.h"
+#include "track.h"
 #include <ros/ros.h>
 #include <interactive_markers/interactive_marker_server.h>
 #include <interactive_markers/menu_handler.h>
@@ -13,23 +15,13 @@
 #include <tf/transform_broadcaster.h>
 #include <tf/transform_listener.h>
 #include <QTime>
+#include <atomic>
 #include <limits>
 
 namespace annotate
 {
 void setRotation(geometry_msgs::Quaternion& quaternion, double x, double y, double z);
 
-struct TrackInstance
-{
-  std::string label;
-  tf::StampedTransform center;
-  tf::Vector3 box_size;
-
-  double timeTo(ros::Time const& time) const;
-};
-
-using Track = std::vector<TrackInstance>;
-
 class AnnotateDisplay;
 
 class AnnotationMarker
@@ -40,6 +32,7 @@ public:
   AnnotationMarker(AnnotateDisplay* markers,
                    const std::shared_ptr<interactive_markers::InteractiveMarkerServer>& server,
                    const TrackInstance& trackInstance, int marker_id);
+  ~AnnotationMarker();
 
   int id() const;
   Track const& track() const;
@@ -48,11 +41,56 @@ public:
   void setLabels(const std::vector<std::string>& labels);
 
   void setTime(const ros::Time& time);
+
+  /**
+   * setTime() in three stages for updating many markers at once: beginTime() and finishTime() must be called from
+   * the GUI thread. updateTime() only touches the marker itself and may run on a worker thread. The caller needs to
+   * schedule a server update afterwards.
+   */
+  bool beginTime(const ros::Time& time);
+  void updateTime();
+  void finishTime();
+
+  /**
+   * Re-evaluate the points around the marker after the transform from the cloud became available
+   */
+  void updateCloudTransform();
+
   void autoFit();
   void undo();
   void commit();
   void rotateYaw(double delta_rad);
 
+  /**
+   * Commit right away if a commit waits for a background shrink, shrinking the box on the calling thread instead
+   */
+  void finishPendingCommit();
+
+  enum FitOperation
+  {
+    AutoFit,
+    Shrink
+  };
+
+  struct FitResult
+  {
+    int marker_id{ -1 };
+    std::shared_ptr<std::atomic<size_t>> token;
+    size_t generation{ 0 };
+    FitOperation operation{ AutoFit };
+    bool fit_orientation{ false };
+    double reference_yaw{ 0.0 };
+    bool success{ false };
+    std::string error;
+    BoxSnapshot box;
+  };
+
+  /**
+   * Apply the result of a fit computed in the background, unless a newer fit was requested or the time changed in
+   * the meantime. Must be called from the GUI thread.
+   */
+  void applyFit(const FitResult& result);
+
 private:
   using MenuHandler = interactive_markers::MenuHandler;
 
@@ -83,17 +121,6 @@ private:
     State state;
   };
 
-  struct PointContext
-  {
-    ros::Time time;
-    size_t points_inside{ 0u };
-    size_t points_nearby{ 0u };
-    tf::Vector3 minimum{ std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
-                         std::numeric_limits<float>::max() };
-    tf::Vector3 maximum{ std::numeric_limits<float>::min(), std::numeric_limits<float>::min(),
-                         std::numeric_limits<float>::min() };
-  };
-
   void updateMenu(const PointContext& context);
   void processFeedback(const visualization_msgs::InteractiveMarkerFeedbackConstPtr& feedback);
   void nextMode();
@@ -115,14 +142,21 @@ private:
   void saveMove();
   void saveForUndo(const std::string& description);
   void undo(const visualization_msgs::InteractiveMarkerFeedbackConstPtr& feedback);
-  void resize(double offset);
+  bool lookupCloudTransform(tf::StampedTransform& transform) const;
   PointContext analyzePoints() const;
+  PointContext analyzePoints(const tf::Transform& cloud_transform) const;
   void shrinkTo(const PointContext& context);
   void shrink(const visualization_msgs::InteractiveMarkerFeedbackConstPtr& feedback);
-  bool fitNearbyPoints();
+  bool fitNearbyPoints(const tf::Transform& cloud_transform);
   void autoFit(const visualization_msgs::InteractiveMarkerFeedbackConstPtr& feedback);
+  bool fitInBackground(FitOperation operation);
+  void finishCommit();
+  double referenceYaw() const;
+  BoxSnapshot snapshot(const tf::Transform& cloud_transform) const;
+  void apply(const BoxSnapshot& box);
   void pull();
   void push();
+  void publish(const PointContext& context);
   void removeControls();
   void createCubeControl();
   void createMoveControl();
@@ -150,6 +184,13 @@ private:
   State state_{ Hidden };
   std::stack<UndoState> undo_stack_;
   bool ignore_ground_{ false };
+  tf::StampedTransform cloud_transform_;
+  bool has_cloud_transform_{ false };
+  bool auto_fit_after_predict_{ false };
+  bool auto_fit_orientation_{ false };
+  PointContext time_context_;
+  std::shared_ptr<std::atomic<size_t>> fit_generation_{ std::make_shared<std::atomic<size_t>>(0u) };
+  bool commit_pending_{ false };
 };
 
 }  // namespace annotate
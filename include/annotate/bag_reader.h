@@ -0,0 +1,114 @@
+#pragma once
+
+#include <ros/serialization.h>
+#include <ros/time.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace annotate
+{
+/**
+ * Random access to the messages of a ROS bag (format version 2.0). The file is memory-mapped and only its index is
+ * read when opening it, so the cost of opening does not depend on the amount of message data. Messages in
+ * uncompressed chunks are deserialized straight from the mapping; bz2 and lz4 compressed chunks are decompressed
+ * when accessed and the last one is kept. Bags that were not closed properly have no index and need to be
+ * reindexed with "rosbag reindex" first.
+ */
+class BagReader
+{
+public:
+  struct Topic
+  {
+    std::string name;
+    std::string type;
+    size_t messages{ 0 };
+  };
+
+  /**
+   * Location of a message in the bag
+   */
+  struct Entry
+  {
+    ros::Time time;
+    uint32_t connection;
+    uint32_t chunk;
+    uint32_t offset;
+  };
+
+  BagReader() = default;
+  ~BagReader();
+  BagReader(const BagReader&) = delete;
+  BagReader& operator=(const BagReader&) = delete;
+
+  bool open(const std::string& file, std::string& error);
+  void close();
+  bool isOpen() const;
+  std::vector<Topic> topics() const;
+  std::string topic(const Entry& entry) const;
+
+  /**
+   * All messages of the given topics in order of their receive time
+   */
+  std::vector<Entry> messages(const std::vector<std::string>& topics) const;
+
+  /**
+   * Serialized data of the message. It stays valid until the next call of read() or close().
+   */
+  bool read(const Entry& entry, const uint8_t*& data, uint32_t& size, std::string& error);
+
+  template <class Message>
+  bool read(const Entry& entry, Message& message, std::string& error)
+  {
+    const uint8_t* data;
+    uint32_t size;
+    if (!read(entry, data, size, error))
+    {
+      return false;
+    }
+    try
+    {
+      ros::serialization::IStream stream(const_cast<uint8_t*>(data), size);
+      ros::serialization::deserialize(stream, message);
+    }
+    catch (const ros::serialization::StreamOverrunException& exception)
+    {
+      error = std::string("Corrupt message: ") + exception.what();
+      return false;
+    }
+    return true;
+  }
+
+private:
+  struct Connection
+  {
+    uint32_t id;
+    std::string topic;
+    std::string type;
+  };
+
+  struct Chunk
+  {
+    uint64_t position;
+    std::string compression;
+    uint32_t size{ 0 };
+    /// Begin and size of the chunk data in the file
+    uint64_t data;
+    uint32_t data_size{ 0 };
+  };
+
+  bool readIndex(std::string& error);
+  bool chunkData(uint32_t chunk, const uint8_t*& data, uint32_t& size, std::string& error);
+
+  void* mapping_{ nullptr };
+  size_t size_{ 0 };
+  std::vector<Connection> connections_;
+  std::vector<Chunk> chunks_;
+  /// Index of each connection, in order of time
+  std::vector<std::vector<Entry>> entries_;
+  uint32_t decompressed_chunk_{ 0 };
+  bool has_decompressed_chunk_{ false };
+  std::vector<uint8_t> decompressed_;
+};
+
+}  // namespace annotate
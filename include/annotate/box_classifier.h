@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace annotate
+{
+/**
+ * An annotation box and its nearby area, both given as axis aligned bounds in the box frame. The transform maps
+ * cloud coordinates into the box frame (row major 3x4 matrix).
+ */
+struct BoxQuery
+{
+  float transform[3][4];
+  double box_min[3];
+  double box_max[3];
+  double nearby_min[3];
+  double nearby_max[3];
+};
+
+/**
+ * Accumulated classification of points. Points within the box are counted as inside, points within the nearby area
+ * but not in the box as nearby. Bounds cover the box frame coordinates of all inside points.
+ */
+struct BoxClassification
+{
+  size_t inside{ 0u };
+  size_t nearby{ 0u };
+  float minimum[3];
+  float maximum[3];
+
+  BoxClassification();
+};
+
+/**
+ * Implementations of the point classification
+ */
+enum class ClassifierKernel
+{
+  Scalar,
+  Sse,
+  Avx2,
+  Avx512
+};
+
+/**
+ * Transform count points given as structure of arrays into the box frame and classify them. Results are added to
+ * result. Uses the widest vector instructions (AVX-512, AVX2, SSE) supported by the CPU at runtime. All
+ * implementations produce identical results, which in turn match a double precision comparison of the transformed
+ * points against the box bounds.
+ */
+void classifyPoints(const BoxQuery& query, float const* x, float const* y, float const* z, size_t count,
+                    BoxClassification& result);
+
+/**
+ * Reference implementation of classifyPoints() without vector instructions.
+ */
+void classifyPointsScalar(const BoxQuery& query, float const* x, float const* y, float const* z, size_t count,
+                          BoxClassification& result);
+
+/**
+ * Kernels supported by this build and the CPU, ordered by vector width. classifyPoints() uses the last one.
+ */
+std::vector<ClassifierKernel> availableClassifierKernels();
+
+/**
+ * classifyPoints() with the given kernel. Returns false and leaves result unchanged if it is not available.
+ */
+bool classifyPoints(ClassifierKernel kernel, const BoxQuery& query, float const* x, float const* y, float const* z,
+                    size_t count, BoxClassification& result);
+
+}  // namespace annotate
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "cloud_cache.h"
+#include "ground_model.h"
+#include "spatial_index.h"
+#include <ros/time.h>
+#include <tf/LinearMath/Transform.h>
+#include <functional>
+#include <limits>
+#include <string>
+
+namespace annotate
+{
+/**
+ * Points of a cloud inside and near a box. Minimum and maximum of the points inside are given in the box frame.
+ */
+struct PointContext
+{
+  ros::Time time;
+  size_t points_inside{ 0u };
+  size_t points_nearby{ 0u };
+  tf::Vector3 minimum{ std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                       std::numeric_limits<float>::max() };
+  tf::Vector3 maximum{ std::numeric_limits<float>::min(), std::numeric_limits<float>::min(),
+                       std::numeric_limits<float>::min() };
+};
+
+/**
+ * A box together with the cloud it is fitted to. Snapshots do not refer to the marker they were taken from, so they
+ * can be analyzed and fitted on a worker thread while the marker keeps changing.
+ */
+struct BoxSnapshot
+{
+  /// Box center in the marker frame
+  tf::Transform pose;
+  tf::Vector3 size;
+  /// Transformation from the cloud frame into the marker frame
+  tf::Transform cloud_transform;
+  bool ignore_ground{ false };
+  CloudCache::Ptr cloud;
+  SpatialIndex::Ptr index;
+  /// If set, shrunk boxes are extended down to the ground
+  GroundModel::Ptr ground;
+};
+
+PointContext analyzePoints(const BoxSnapshot& box);
+
+/**
+ * Move and resize the box such that it tightly encloses the points inside of it (plus a small margin). With a
+ * ground model, the bottom of the box is placed on the ground below its center.
+ */
+void shrinkTo(BoxSnapshot& box, const PointContext& context);
+
+/**
+ * Grow the box as little as possible until there are no more points nearby, then shrink it to the points inside.
+ * Done in a single pass over the points around the box. When ignoring the ground, the bottom of the box stays in
+ * place and the box only grows upwards. Returns false with a reason in error and leaves the box unchanged if no such
+ * box is found or cancelled() returns true in between.
+ */
+bool fitNearbyPoints(BoxSnapshot& box, std::string& error,
+                     const std::function<bool()>& cancelled = std::function<bool()>());
+
+/**
+ * Auto-fit the box like fitNearbyPoints() and turn it about its z axis to the enclosing rectangle whose sides are
+ * closest to the points inside, viewed from above. The x axis ends up along the longer side, pointing in the
+ * direction closest to reference_yaw (yaw in the marker frame).
+ */
+bool fitOrientation(BoxSnapshot& box, double reference_yaw, std::string& error,
+                    const std::function<bool()>& cancelled = std::function<bool()>());
+
+}  // namespace annotate
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <ros/time.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace annotate
+{
+/**
+ * Point coordinates of a single point cloud message, decoded once and stored as a structure of arrays. A cache is
+ * immutable after construction and shared read-only by all annotations until the next point cloud arrives.
+ * Points with non-finite coordinates are dropped while decoding.
+ */
+class CloudCache
+{
+public:
+  using Ptr = std::shared_ptr<CloudCache const>;
+
+  explicit CloudCache(const sensor_msgs::PointCloud2& cloud);
+  CloudCache(const std::string& frame_id, const ros::Time& stamp, std::vector<float> x, std::vector<float> y,
+             std::vector<float> z);
+
+  std::string const& frameId() const;
+  ros::Time const& stamp() const;
+  size_t size() const;
+  bool empty() const;
+
+  float const* x() const;
+  float const* y() const;
+  float const* z() const;
+
+private:
+  std::string frame_id_;
+  ros::Time stamp_;
+  std::vector<float> x_;
+  std::vector<float> y_;
+  std::vector<float> z_;
+};
+
+}  // namespace annotate
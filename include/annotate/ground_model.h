@@ -0,0 +1,48 @@
+#pragma once
+
+#include "cloud_cache.h"
+#include <memory>
+#include <vector>
+
+namespace annotate
+{
+/**
+ * Ground surface of a point cloud, estimated as a 2.5D elevation grid. The ground is assumed to rise by at most
+ * max_slope: the height of a cell is the lowest point of any cell plus max_slope times its distance. Objects do not
+ * lift the ground regardless of their length; below them, the ground is estimated at most max_slope times half
+ * their width too high. Points up to tolerance above the ground height of their cell are ground points. The z axis
+ * of the cloud frame is assumed to point upwards.
+ */
+class GroundModel
+{
+public:
+  using Ptr = std::shared_ptr<GroundModel const>;
+
+  explicit GroundModel(const CloudCache& cloud, float cell_size = 0.5f, float tolerance = 0.2f,
+                       float max_slope = 0.15f);
+
+  /**
+   * Ground height at the given position in the cloud frame. Returns false where no ground is known.
+   */
+  bool height(float x, float y, float& z) const;
+
+  /**
+   * All points of the cloud that are not ground points
+   */
+  CloudCache::Ptr objects() const;
+  size_t groundPoints() const;
+
+private:
+  bool cell(float x, float y, size_t& index) const;
+
+  float cell_size_;
+  float min_x_{ 0.0f };
+  float min_y_{ 0.0f };
+  size_t columns_{ 0 };
+  size_t rows_{ 0 };
+  std::vector<float> heights_;
+  CloudCache::Ptr objects_;
+  size_t ground_points_{ 0 };
+};
+
+}  // namespace annotate
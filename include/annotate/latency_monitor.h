@@ -0,0 +1,105 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace annotate
+{
+/**
+ * Latency histograms of the sections of code that keep the GUI busy. Durations are counted in logarithmic buckets,
+ * four per power of two starting at one microsecond, so percentiles are accurate to about 20%. Recording is lock-free
+ * and may happen from any thread. Statistics cover the last few periods, each ended by a call to advance().
+ * While disabled, timers do not even read the clock.
+ */
+class LatencyMonitor
+{
+public:
+  enum Section
+  {
+    HandlePointcloud,
+    AnalyzePoints,
+    FitNearbyPoints,
+    Save,
+    Load,
+    PublishTrackMarkers,
+    Push,
+    Sections
+  };
+
+  /**
+   * Percentiles and maximum in seconds
+   */
+  struct Statistics
+  {
+    size_t count{ 0 };
+    double p50{ 0.0 };
+    double p95{ 0.0 };
+    double p99{ 0.0 };
+    double maximum{ 0.0 };
+  };
+
+  /**
+   * Records the time from its construction to its destruction
+   */
+  class Timer
+  {
+  public:
+    Timer(LatencyMonitor& monitor, Section section);
+    ~Timer();
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+  private:
+    LatencyMonitor& monitor_;
+    Section section_;
+    bool running_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  /**
+   * Statistics span the given number of periods
+   */
+  explicit LatencyMonitor(size_t periods = 10);
+  LatencyMonitor(const LatencyMonitor&) = delete;
+  LatencyMonitor& operator=(const LatencyMonitor&) = delete;
+
+  void setEnabled(bool enabled);
+  bool enabled() const;
+  void record(Section section, std::chrono::nanoseconds duration);
+
+  /**
+   * Start a new period and drop the oldest one. Not thread-safe with respect to itself and statistics().
+   */
+  void advance();
+
+  /**
+   * Statistics of the last periods, not including the current one
+   */
+  Statistics statistics(Section section) const;
+
+  /**
+   * Drop all recorded durations
+   */
+  void clear();
+  static std::string name(Section section);
+
+private:
+  static size_t const buckets = 128;
+  using Counts = std::array<uint32_t, buckets>;
+
+  static size_t bucket(std::chrono::nanoseconds duration);
+  static double upperBound(size_t bucket);
+
+  std::atomic<bool> enabled_{ false };
+  std::array<std::array<std::atomic<uint32_t>, buckets>, Sections> current_;
+  std::array<std::atomic<uint64_t>, Sections> maximum_;
+  std::vector<std::array<Counts, Sections>> periods_;
+  std::vector<std::array<uint64_t, Sections>> period_maximum_;
+  size_t period_{ 0 };
+};
+
+}  // namespace annotate
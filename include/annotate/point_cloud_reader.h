@@ -0,0 +1,89 @@
+#pragma once
+
+#include <sensor_msgs/PointCloud2.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace annotate
+{
+/**
+ * Destination of the coordinates read from a point cloud. Points with non-finite coordinates are skipped.
+ */
+struct PointBuffer
+{
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> z;
+
+  void append(float px, float py, float pz)
+  {
+    if (std::isfinite(px) && std::isfinite(py) && std::isfinite(pz))
+    {
+      x.push_back(px);
+      y.push_back(py);
+      z.push_back(pz);
+    }
+  }
+};
+
+/**
+ * Reads x, y and z coordinates directly from the data of a sensor_msgs::PointCloud2 message without intermediate
+ * conversions. Scalar is the field type of all three coordinates, PointStep the point size in bytes if known at
+ * compile time (0 otherwise). Organized clouds with padded rows are supported.
+ */
+template <typename Scalar, uint32_t PointStep = 0>
+class PointCloudReader
+{
+public:
+  PointCloudReader(const sensor_msgs::PointCloud2& cloud, uint32_t x_offset, uint32_t y_offset, uint32_t z_offset)
+    : cloud_(cloud), x_offset_(x_offset), y_offset_(y_offset), z_offset_(z_offset)
+  {
+  }
+
+  void read(PointBuffer& buffer) const
+  {
+    uint32_t const point_step = PointStep ? PointStep : cloud_.point_step;
+    uint32_t const height = std::max(1u, cloud_.height);
+    for (uint32_t row = 0; row < height; ++row)
+    {
+      size_t const row_start = size_t(row) * cloud_.row_step;
+      if (row_start >= cloud_.data.size())
+      {
+        return;
+      }
+      size_t const available = (cloud_.data.size() - row_start) / point_step;
+      size_t const width = std::min(size_t(cloud_.width), available);
+      uint8_t const* point = cloud_.data.data() + row_start;
+      for (size_t i = 0; i < width; ++i, point += point_step)
+      {
+        buffer.append(float(load(point + x_offset_)), float(load(point + y_offset_)), float(load(point + z_offset_)));
+      }
+    }
+  }
+
+private:
+  static Scalar load(uint8_t const* data)
+  {
+    Scalar value;
+    std::memcpy(&value, data, sizeof(Scalar));
+    return value;
+  }
+
+  const sensor_msgs::PointCloud2& cloud_;
+  uint32_t const x_offset_;
+  uint32_t const y_offset_;
+  uint32_t const z_offset_;
+};
+
+/**
+ * Read all points of cloud into buffer. Common float32 layouts (x, y, z at the start of points of 16, 32 or 48 bytes,
+ * as used by pcl::PointXYZ(I), Velodyne and Ouster drivers) use specialized readers, float32 and float64 fields at
+ * arbitrary offsets a generic one. Other field types and foreign byte order are converted per value. Returns false if
+ * the cloud has no x, y and z fields.
+ */
+bool readPoints(const sensor_msgs::PointCloud2& cloud, PointBuffer& buffer);
+
+}  // namespace annotate
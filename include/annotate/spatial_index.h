@@ -0,0 +1,58 @@
+#pragma once
+
+#include "cloud_cache.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace annotate
+{
+struct AlignedBox
+{
+  float minimum[3];
+  float maximum[3];
+};
+
+struct PointRange
+{
+  uint32_t begin;
+  uint32_t end;
+};
+
+/**
+ * Spatial index over the points of a CloudCache. Points are reordered such that all points of a cell (voxel hash) or
+ * leaf (k-d tree) are stored contiguously, and queries return ranges into the reordered coordinate arrays. Ranges
+ * cover all points inside the queried box, but may include points outside of it as well.
+ */
+class SpatialIndex
+{
+public:
+  using Ptr = std::shared_ptr<SpatialIndex const>;
+
+  enum Type
+  {
+    VoxelHash,
+    KdTree
+  };
+
+  virtual ~SpatialIndex() = default;
+
+  static Ptr create(Type type, const CloudCache& cloud);
+
+  virtual void query(const AlignedBox& box, std::vector<PointRange>& ranges) const = 0;
+
+  size_t size() const;
+  float const* x() const;
+  float const* y() const;
+  float const* z() const;
+
+protected:
+  void reorder(const CloudCache& cloud, const std::vector<uint32_t>& order);
+  static void append(std::vector<PointRange>& ranges, uint32_t begin, uint32_t end);
+
+  std::vector<float> x_;
+  std::vector<float> y_;
+  std::vector<float> z_;
+};
+
+}  // namespace annotate
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace annotate
+{
+/**
+ * Timeline of the code sections executed by each thread, written in the Chrome trace event format that Perfetto and
+ * chrome://tracing load. Every thread records into its own ring buffer without locking; when a buffer is full, the
+ * oldest events of that thread are overwritten. Buffers are read while threads keep recording, events that are
+ * overwritten during a read are left out. While disabled, scopes do not even read the clock.
+ */
+class TraceRecorder
+{
+public:
+  /**
+   * Records the time from its construction to its destruction. name must be a string literal or outlive the
+   * recorder. A negative marker_id means the section does not belong to a marker.
+   */
+  class Scope
+  {
+  public:
+    Scope(TraceRecorder& recorder, const char* name, int64_t marker_id = -1);
+    ~Scope();
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+  private:
+    TraceRecorder& recorder_;
+    const char* name_;
+    int64_t marker_id_;
+    int64_t begin_{ -1 };
+  };
+
+  /**
+   * Each thread keeps its last events_per_thread events
+   */
+  explicit TraceRecorder(size_t events_per_thread = 1 << 16);
+  TraceRecorder(const TraceRecorder&) = delete;
+  TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+  void setEnabled(bool enabled);
+  bool enabled() const;
+
+  /**
+   * Record a section of the calling thread. Times are nanoseconds of the steady clock.
+   */
+  void record(const char* name, int64_t marker_id, int64_t begin, int64_t end);
+
+  /**
+   * Name the calling thread in the trace
+   */
+  void setThreadName(const std::string& name);
+
+  /**
+   * Number of events currently held in all buffers
+   */
+  size_t events() const;
+
+  /**
+   * Write all recorded events to file as Chrome trace JSON. The file is replaced atomically.
+   */
+  bool write(const std::string& file, std::string& error) const;
+  static int64_t now();
+
+private:
+  struct Event
+  {
+    std::atomic<const char*> name{ nullptr };
+    std::atomic<int64_t> marker_id{ -1 };
+    std::atomic<int64_t> begin{ 0 };
+    std::atomic<int64_t> end{ 0 };
+  };
+
+  struct Buffer
+  {
+    explicit Buffer(size_t capacity) : events(capacity)
+    {
+    }
+
+    std::vector<Event> events;
+    /// Number of events whose recording started and finished. Event i is stored at events[i % events.size()].
+    std::atomic<uint64_t> started{ 0 };
+    std::atomic<uint64_t> written{ 0 };
+    int64_t thread_id{ 0 };
+    std::string thread_name;
+  };
+
+  Buffer& buffer();
+
+  uint64_t const id_;
+  size_t const capacity_;
+  std::atomic<bool> enabled_{ false };
+  mutable std::mutex mutex_;
+  std::vector<std::shared_ptr<Buffer>> buffers_;
+};
+
+}  // namespace annotate
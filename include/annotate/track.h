@@ -0,0 +1,70 @@
+#pragma once
+
+#include <ros/time.h>
+#include <tf/transform_datatypes.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace annotate
+{
+struct TrackInstance
+{
+  std::string label;
+  tf::StampedTransform center;
+  tf::Vector3 box_size;
+
+  double timeTo(ros::Time const& time) const;
+};
+
+/**
+ * Instances of a track, kept sorted by time stamp. Instances are stored contiguously; lookups use binary search.
+ * Inserting at the end (the common case when annotating forward in time) takes amortized O(log n), inserting in
+ * between additionally moves the later instances.
+ */
+class Track
+{
+public:
+  using const_iterator = std::vector<TrackInstance>::const_iterator;
+
+  /**
+   * Insert instance, replacing an existing instance with the same time stamp
+   */
+  void insert(const TrackInstance& instance);
+  void reserve(size_t size);
+  void clear();
+
+  bool empty() const;
+  size_t size() const;
+  const_iterator begin() const;
+  const_iterator end() const;
+  const TrackInstance& front() const;
+  const TrackInstance& back() const;
+
+  /**
+   * The instance closest to time if it is at most tolerance seconds away, nullptr otherwise
+   */
+  const TrackInstance* find(const ros::Time& time, double tolerance) const;
+
+  /**
+   * The two instances closest to time, closest first. Returns false if the track has less than two instances.
+   */
+  bool nearest(const ros::Time& time, const TrackInstance*& first, const TrackInstance*& second) const;
+
+  /**
+   * All instances with a time stamp in [begin, end]
+   */
+  std::pair<const_iterator, const_iterator> range(const ros::Time& begin, const ros::Time& end) const;
+
+private:
+  const_iterator lowerBound(const ros::Time& time) const;
+
+  std::vector<TrackInstance> instances_;
+};
+
+/**
+ * Whether time lies within the time span of track, extended by margin seconds on both ends
+ */
+bool spans(const Track& track, const ros::Time& time, double margin);
+
+}  // namespace annotate
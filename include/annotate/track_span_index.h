@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace annotate
+{
+/**
+ * Interval tree over the time spans of tracks. Spans are stored sorted by start time in an implicit balanced binary
+ * tree where each node knows the latest end time in its subtree. A query visits O(log n + k) nodes for k results.
+ * Times are in seconds.
+ */
+class TrackSpanIndex
+{
+public:
+  void clear();
+
+  /**
+   * Add a span. Call build() after adding all spans and before querying.
+   */
+  void insert(int id, double begin, double end);
+  void build();
+
+  bool empty() const;
+
+  /**
+   * Ids of all tracks whose span overlaps [begin, end], ordered by span start
+   */
+  void query(double begin, double end, std::vector<int>& ids) const;
+
+private:
+  struct Span
+  {
+    double begin;
+    double end;
+    int id;
+  };
+
+  double build(size_t begin, size_t end);
+  void query(size_t begin, size_t end, double query_begin, double query_end, std::vector<int>& ids) const;
+
+  std::vector<Span> spans_;
+  std::vector<double> latest_end_;
+};
+
+}  // namespace annotate
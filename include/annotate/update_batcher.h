@@ -0,0 +1,42 @@
+#pragma once
+
+#include <interactive_markers/interactive_marker_server.h>
+#include <QElapsedTimer>
+#include <QObject>
+#include <QTimer>
+#include <memory>
+
+namespace annotate
+{
+/**
+ * Coalesces InteractiveMarkerServer::applyChanges() calls. Any number of update requests during one Qt event loop
+ * iteration result in a single applyChanges() call, which is additionally delayed to honor a maximum update rate.
+ */
+class UpdateBatcher : public QObject
+{
+  Q_OBJECT
+public:
+  explicit UpdateBatcher(const std::shared_ptr<interactive_markers::InteractiveMarkerServer>& server,
+                         QObject* parent = nullptr);
+
+  /**
+   * Apply pending server changes in one of the next event loop iterations
+   */
+  void schedule();
+
+  /**
+   * Maximum number of applyChanges() calls per second. Zero or negative values disable rate limiting.
+   */
+  void setMaximumRate(double rate);
+
+public Q_SLOTS:
+  void flush();
+
+private:
+  std::shared_ptr<interactive_markers::InteractiveMarkerServer> server_;
+  QTimer timer_;
+  QElapsedTimer last_flush_;
+  int minimum_interval_{ 0 };
+};
+
+}  // namespace annotate
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace annotate
+{
+/**
+ * Fixed set of worker threads processing queued tasks in order of submission.
+ */
+class WorkerPool
+{
+public:
+  /**
+   * Create a pool with the given number of threads. Zero uses one thread per hardware thread.
+   */
+  explicit WorkerPool(size_t threads = 0);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  size_t size() const;
+
+  /**
+   * Queue task for execution by a worker thread. The returned future provides its result.
+   */
+  template <class Function>
+  std::future<typename std::result_of<Function()>::type> submit(Function task)
+  {
+    using Result = typename std::result_of<Function()>::type;
+    auto packaged = std::make_shared<std::packaged_task<Result()>>(std::move(task));
+    auto future = packaged->get_future();
+    enqueue([packaged]() { (*packaged)(); });
+    return future;
+  }
+
+  /**
+   * Call task for each index in [0, count) and return when all calls are done. The calling thread takes part in
+   * processing. Tasks for different indices may run concurrently and in any order.
+   */
+  void parallelFor(size_t count, const std::function<void(size_t)>& task);
+
+private:
+  void enqueue(std::function<void()> task);
+  void run();
+
+  std::vector<std::thread> threads_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  bool stop_{ false };
+};
+
+}  // namespace annotate
@@ -1,7 +1,8 @@
 #include <annotate/annotate_display.h>
+#include <algorithm>
+#include <iomanip>
+#include <iterator>
 #include <sstream>
-#include <yaml-cpp/yaml.h>
-#include <fstream>
 #include <visualization_msgs/MarkerArray.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <pcl/point_cloud.h>
@@ -63,20 +64,21 @@ std_msgs::ColorRGBA createColor(int id)
   return result;
 }
 
-Marker createTrackLine(float scale, const std_msgs::ColorRGBA& color)
+/**
+ * Marker setup functions reinitialize reused markers, keeping the memory allocated for their points
+ */
+void initTrackLine(Marker& marker, float scale, const std_msgs::ColorRGBA& color)
 {
-  Marker marker;
   marker.type = Marker::LINE_STRIP;
   setRotation(marker.pose.orientation, 0.0, 0.0, 0.0);
   marker.color = color;
   marker.color.a = 0.7;
   marker.scale.x = scale;
-  return marker;
+  marker.points.clear();
 }
 
-Marker createTrackSpheres(float scale, const std_msgs::ColorRGBA& color)
+void initTrackSpheres(Marker& marker, float scale, const std_msgs::ColorRGBA& color)
 {
-  Marker marker;
   marker.type = Marker::SPHERE_LIST;
   setRotation(marker.pose.orientation, 0.0, 0.0, 0.0);
   marker.color = color;
@@ -84,7 +86,44 @@ Marker createTrackSpheres(float scale, const std_msgs::ColorRGBA& color)
   marker.scale.x = scale;
   marker.scale.y = scale;
   marker.scale.z = scale;
-  return marker;
+  marker.points.clear();
+}
+
+/** Number of journal records that trigger a compaction right away */
+size_t const compaction_threshold = 1000;
+
+/**
+ * Spatial index over the points of cloud. With remove_ground, ground points are estimated and left out.
+ */
+pair<SpatialIndex::Ptr, GroundModel::Ptr> indexCloud(const CloudCache::Ptr& cloud, SpatialIndex::Type type,
+                                                     bool remove_ground)
+{
+  if (!remove_ground)
+  {
+    return make_pair(SpatialIndex::create(type, *cloud), GroundModel::Ptr());
+  }
+  auto ground = make_shared<GroundModel const>(*cloud);
+  return make_pair(SpatialIndex::create(type, *ground->objects()), GroundModel::Ptr(ground));
+}
+
+// How long to wait for tf data at the cloud time before falling back to the latest transform
+chrono::milliseconds const transform_timeout(250);
+
+/**
+ * Decode the given tracks (by id, with their index in file) and add them to data in order of id
+ */
+void addTracks(const BinaryAnnotationFile& file, const map<int, size_t>& tracks, AnnotationData& data)
+{
+  data.tracks.reserve(data.tracks.size() + tracks.size());
+  for (auto const& entry : tracks)
+  {
+    AnnotationTrack track;
+    track.id = size_t(entry.first);
+    track.track = file.trackInstances(entry.second);
+    data.tracks.push_back(move(track));
+  }
+  sort(data.tracks.begin(), data.tracks.end(),
+       [](const AnnotationTrack& a, const AnnotationTrack& b) { return a.id < b.id; });
 }
 
 }  // namespace internal
@@ -102,30 +141,235 @@ void AnnotateDisplay::createNewAnnotation(const geometry_msgs::PointStamped::Con
   marker->setLabels(labels_);
   marker->setIgnoreGround(ignore_ground_property_->getBool());
   marker->setTime(time_);
-  markers_.push_back(marker);
+  markers_[marker->id()] = marker;
 }
 
 void AnnotateDisplay::handlePointcloud(const sensor_msgs::PointCloud2ConstPtr& cloud)
 {
+  LatencyMonitor::Timer timer(latency_monitor_, LatencyMonitor::HandlePointcloud);
+  TraceRecorder::Scope scope(trace_recorder_, "handlePointcloud");
   cloud_ = cloud;
+  cloud_cache_ = make_shared<CloudCache const>(*cloud);
+  transform_cache_.clear();
+
+  // Ground estimation and indexing run on a worker while the markers switch to the new time. Until then, the
+  // previous index stays in place for commits of the previous time that are completed in beginTime(). The markers
+  // are updated in finishPointcloud() once the index is available.
+  auto const cache = cloud_cache_;
+  auto const index_type = SpatialIndex::Type(spatial_index_property_->getOptionInt());
+  bool const remove_ground = ignore_ground_property_->getBool();
+  auto const generation = ++cloud_generation_;
+  worker_pool_.submit([this, cache, index_type, remove_ground, generation]() {
+    auto const indexed = internal::indexCloud(cache, index_type, remove_ground);
+    {
+      lock_guard<mutex> lock(indexed_cloud_mutex_);
+      if (generation > indexed_cloud_.generation)
+      {
+        indexed_cloud_.generation = generation;
+        indexed_cloud_.index = indexed.first;
+        indexed_cloud_.ground = indexed.second;
+      }
+    }
+    QMetaObject::invokeMethod(this, "finishPointcloud", Qt::QueuedConnection);
+  });
   time_ = cloud->header.stamp;
   if (pause_after_data_change_->getBool())
   {
     sendPlaybackCommand(Pause);
   }
-  for (auto& marker : markers_)
+
+  updateActiveMarkers();
+  indexing_markers_.clear();
+  for (auto const& marker : markers_)
+  {
+    if (marker.second->beginTime(time_))
+    {
+      indexing_markers_.push_back(marker.first);
+    }
+  }
+}
+
+void AnnotateDisplay::finishPointcloud()
+{
+  IndexedCloud indexed;
+  {
+    lock_guard<mutex> lock(indexed_cloud_mutex_);
+    if (indexed_cloud_.generation != cloud_generation_ || !indexed_cloud_.index)
+    {
+      // Superseded by a newer cloud or already done
+      return;
+    }
+    indexed = indexed_cloud_;
+    indexed_cloud_.index.reset();
+    indexed_cloud_.ground.reset();
+  }
+  TraceRecorder::Scope scope(trace_recorder_, "finishPointcloud");
+  spatial_index_ = indexed.index;
+  ground_model_ = indexed.ground;
+
+  // Markers are analyzed and fitted in parallel, then published in their original order
+  vector<AnnotationMarker*> active_markers;
+  for (auto const id : indexing_markers_)
+  {
+    auto const marker = markers_.find(id);
+    if (marker != markers_.end())
+    {
+      active_markers.push_back(marker->second.get());
+    }
+  }
+  indexing_markers_.clear();
+  worker_pool_.parallelFor(active_markers.size(), [&active_markers](size_t i) { active_markers[i]->updateTime(); });
+  for (auto* marker : active_markers)
   {
-    marker->setTime(time_);
+    marker->finishTime();
   }
+  scheduleServerUpdate();
   publishTrackMarkers();
+
+  stringstream stream;
+  stream << transform_cache_hits_ << " hits, " << transform_cache_misses_ << " misses";
+  setStatusStd(rviz::StatusProperty::Ok, "Transform Cache", stream.str());
+}
+
+void AnnotateDisplay::updateActiveMarkers()
+{
+  // Tracks are kept as plain data. Markers only exist while the time is within a track's span (plus the second
+  // AnnotationMarker::beginTime() keeps them visible) and for new annotations that have no track yet.
+  bool removed = false;
+  for (auto marker = markers_.begin(); marker != markers_.end();)
+  {
+    auto const track = tracks_.find(marker->first);
+    if (track != tracks_.end() && !spans(track->second, time_, 1.0))
+    {
+      // A commit waiting for a background shrink is saved for the old time before the marker goes away. Should it
+      // extend the track up to the current time, the marker is created again below.
+      marker->second->finishPendingCommit();
+      if (current_marker_ == marker->second.get())
+      {
+        current_marker_ = nullptr;
+      }
+      marker = markers_.erase(marker);
+      removed = true;
+    }
+    else
+    {
+      ++marker;
+    }
+  }
+
+  if (removed)
+  {
+    // Drop the feedback callbacks of removed markers from the server right away
+    update_batcher_->flush();
+  }
+
+  bool const ignore_ground = ignore_ground_property_ && ignore_ground_property_->getBool();
+  vector<int> ids;
+  auto const time = time_.toSec();
+  trackSpans().query(time - 1.001, time + 1.001, ids);
+  for (auto const id : ids)
+  {
+    if (markers_.find(id) != markers_.end())
+    {
+      continue;
+    }
+    auto const& instances = track(id);
+    if (spans(instances, time_, 1.0))
+    {
+      auto created = make_shared<AnnotationMarker>(this, server_, instances.front(), id);
+      created->setLabels(labels_);
+      created->setTrack(instances);
+      created->setIgnoreGround(ignore_ground);
+      markers_[id] = created;
+    }
+  }
+}
+
+const TrackSpanIndex& AnnotateDisplay::trackSpans()
+{
+  if (!track_spans_valid_)
+  {
+    track_spans_.clear();
+    for (auto const& track : tracks_)
+    {
+      if (!track.second.empty())
+      {
+        track_spans_.insert(track.first, track.second.front().center.stamp_.toSec(),
+                            track.second.back().center.stamp_.toSec());
+      }
+    }
+    for (auto const& track : lazy_tracks_)
+    {
+      auto const& span = binary_file_->track(track.second);
+      if (span.begin < span.end && span.end <= binary_file_->instances())
+      {
+        track_spans_.insert(track.first, binary_file_->stamp(span.begin).toSec(),
+                            binary_file_->stamp(span.end - 1).toSec());
+      }
+    }
+    track_spans_.build();
+    track_spans_valid_ = true;
+  }
+  return track_spans_;
+}
+
+Track& AnnotateDisplay::track(int id)
+{
+  auto const lazy = lazy_tracks_.find(id);
+  if (lazy != lazy_tracks_.end())
+  {
+    tracks_[id] = binary_file_->trackInstances(lazy->second);
+    lazy_tracks_.erase(lazy);
+  }
+  return tracks_[id];
 }
 
 AnnotateDisplay::AnnotateDisplay()
 {
   server_ = make_shared<InteractiveMarkerServer>("annotate_node", "", false);
-  track_marker_publisher_ = node_handle_.advertise<visualization_msgs::MarkerArray>("tracks", 10, true);
+  update_batcher_ = new UpdateBatcher(server_, this);
+  // Track markers are sent as changes only. New subscribers get the complete state.
+  track_marker_publisher_ = node_handle_.advertise<visualization_msgs::MarkerArray>(
+      "tracks", 10, boost::bind(&AnnotateDisplay::resendTrackMarkers, this, _1), ros::SubscriberStatusCallback(),
+      ros::VoidConstPtr(), true);
   new_annotation_subscriber_ =
       node_handle_.subscribe("/new_annotation", 10, &AnnotateDisplay::createNewAnnotation, this);
+  journal_sync_timer_ = new QTimer(this);
+  journal_sync_timer_->setSingleShot(true);
+  journal_sync_timer_->setInterval(1000);
+  connect(journal_sync_timer_, SIGNAL(timeout()), this, SLOT(syncJournal()));
+  compaction_timer_ = new QTimer(this);
+  compaction_timer_->setInterval(30000);
+  connect(compaction_timer_, SIGNAL(timeout()), this, SLOT(compactJournal()));
+  compaction_timer_->start();
+  pending_transform_timer_ = new QTimer(this);
+  pending_transform_timer_->setSingleShot(true);
+  connect(pending_transform_timer_, SIGNAL(timeout()), this, SLOT(processPendingTransforms()));
+  bag_playback_timer_ = new QTimer(this);
+  bag_playback_timer_->setSingleShot(true);
+  connect(bag_playback_timer_, SIGNAL(timeout()), this, SLOT(playBag()));
+  latency_timer_ = new QTimer(this);
+  latency_timer_->setInterval(1000);
+  connect(latency_timer_, SIGNAL(timeout()), this, SLOT(publishLatencyStatistics()));
+  transforms_changed_connection_ =
+      transform_listener_.addTransformsChangedListener(boost::bind(&AnnotateDisplay::notifyTransformsChanged, this));
+}
+
+AnnotateDisplay::~AnnotateDisplay()
+{
+  if (trace_recorder_.enabled())
+  {
+    writeTrace();
+  }
+  transform_listener_.removeTransformsChangedListener(transforms_changed_connection_);
+  if (loading_.valid())
+  {
+    loading_.wait();
+  }
+  if (compaction_.valid() && compaction_.get().empty())
+  {
+    journal_.removeRotated();
+  }
 }
 
 template <class T>
@@ -143,6 +387,7 @@ void AnnotateDisplay::modifyChild(rviz::Property* parent, QString const& name, s
 
 void AnnotateDisplay::autoFitPoints()
 {
+  TraceRecorder::Scope scope(trace_recorder_, "autoFitPoints", currentMarkerId());
   if (current_marker_)
   {
     current_marker_->autoFit();
@@ -151,6 +396,7 @@ void AnnotateDisplay::autoFitPoints()
 
 void AnnotateDisplay::undo()
 {
+  TraceRecorder::Scope scope(trace_recorder_, "undo", currentMarkerId());
   if (current_marker_)
   {
     current_marker_->undo();
@@ -159,6 +405,7 @@ void AnnotateDisplay::undo()
 
 void AnnotateDisplay::commit()
 {
+  TraceRecorder::Scope scope(trace_recorder_, "commit", currentMarkerId());
   if (current_marker_)
   {
     current_marker_->commit();
@@ -171,6 +418,7 @@ void AnnotateDisplay::commit()
 
 void AnnotateDisplay::rotateClockwise()
 {
+  TraceRecorder::Scope scope(trace_recorder_, "rotateClockwise", currentMarkerId());
   if (current_marker_)
   {
     current_marker_->rotateYaw(-0.01);
@@ -179,6 +427,7 @@ void AnnotateDisplay::rotateClockwise()
 
 void AnnotateDisplay::rotateAntiClockwise()
 {
+  TraceRecorder::Scope scope(trace_recorder_, "rotateAntiClockwise", currentMarkerId());
   if (current_marker_)
   {
     current_marker_->rotateYaw(0.01);
@@ -187,6 +436,19 @@ void AnnotateDisplay::rotateAntiClockwise()
 
 void AnnotateDisplay::sendPlaybackCommand(PlaybackCommand command)
 {
+  if (bag_.isOpen())
+  {
+    if (command == Play || (command == Toggle && !bag_playback_timer_->isActive()))
+    {
+      bag_playback_timer_->start(0);
+    }
+    else
+    {
+      bag_playback_timer_->stop();
+    }
+    return;
+  }
+
   if (!playback_client_.isValid())
   {
     QStringList services;
@@ -260,9 +522,47 @@ void AnnotateDisplay::sendPlaybackCommand(PlaybackCommand command)
 
 void AnnotateDisplay::togglePlayPause()
 {
+  TraceRecorder::Scope scope(trace_recorder_, "togglePlayPause");
   sendPlaybackCommand(Toggle);
 }
 
+void AnnotateDisplay::previousFrame()
+{
+  TraceRecorder::Scope scope(trace_recorder_, "previousFrame");
+  if (bag_.isOpen() && bag_frame_ > 0)
+  {
+    bag_playback_timer_->stop();
+    showBagFrame(bag_frame_ - 1);
+  }
+}
+
+void AnnotateDisplay::nextFrame()
+{
+  TraceRecorder::Scope scope(trace_recorder_, "nextFrame");
+  if (bag_.isOpen() && bag_frame_ + 1 < bag_clouds_.size())
+  {
+    bag_playback_timer_->stop();
+    showBagFrame(bag_frame_ + 1);
+  }
+}
+
+void AnnotateDisplay::playBag()
+{
+  if (!bag_.isOpen() || bag_frame_ + 1 >= bag_clouds_.size())
+  {
+    return;
+  }
+
+  // Frames follow each other as recorded. Pausing after the points change stops the timer again.
+  auto const frame = bag_frame_ + 1;
+  if (frame + 1 < bag_clouds_.size())
+  {
+    auto const interval = (bag_clouds_[frame + 1].time - bag_clouds_[frame].time).toSec();
+    bag_playback_timer_->start(int(1000 * min(1.0, max(0.0, interval))));
+  }
+  showBagFrame(frame);
+}
+
 void AnnotateDisplay::updateShortcuts()
 {
   auto const enabled = shortcuts_property_->getBool();
@@ -303,6 +603,17 @@ void AnnotateDisplay::onInitialize()
 
   topic_property_ = new rviz::RosTopicProperty("Topic", QString(), "sensor_msgs/PointCloud2", "Point cloud to annotate",
                                                this, SLOT(updateTopic()), this);
+  bag_file_property_ =
+      new FileDialogProperty("Bag File", QString(),
+                             "Read the point clouds of the topic and transforms directly from this bag instead of "
+                             "subscribing to them. Frames are stepped by shortcut or the Frame property and played "
+                             "back without rosbag play.",
+                             this, SLOT(openBag()), this);
+  bag_file_property_->setMode(FileDialogProperty::OpenFileName);
+  bag_frame_property_ = new rviz::IntProperty("Frame", 0, "Index of the point cloud in the bag", bag_file_property_,
+                                              SLOT(updateBagFrame()), this);
+  bag_frame_property_->setMin(0);
+  bag_frame_property_->setHidden(true);
   open_file_property_ = new FileDialogProperty("Open", QString(), "Open an existing annotation file for editing", this,
                                                SLOT(openFile()), this);
   open_file_property_->setIcon(rviz::loadPixmap(QString("package://annotate/icons/open.svg")));
@@ -318,8 +629,46 @@ void AnnotateDisplay::onInitialize()
                                                    "Enable to ignore the ground direction (negative z) when "
                                                    "shrinking "
                                                    "or fitting boxes. This is useful if the point cloud contains "
-                                                   "ground points that should not be included in annotations.",
+                                                   "ground points that should not be included in annotations. "
+                                                   "Ground points are estimated for each point cloud and left out, "
+                                                   "and fitted boxes are extended down to the ground.",
                                                    this, SLOT(updateIgnoreGround()), this);
+  spatial_index_property_ = new rviz::EnumProperty("Spatial Index", "Voxel Hash",
+                                                   "Data structure used to find the points near annotation boxes.",
+                                                   this, SLOT(updateSpatialIndex()), this);
+  spatial_index_property_->addOption("Voxel Hash", SpatialIndex::VoxelHash);
+  spatial_index_property_->addOption("k-d Tree", SpatialIndex::KdTree);
+  marker_update_rate_property_ =
+      new rviz::FloatProperty("Marker Update Rate", 30.0f,
+                              "Maximum number of annotation updates sent to RViz per second. Changes in between are "
+                              "combined into a single update. Use 0 to send one update per event loop iteration.",
+                              this, SLOT(updateMarkerUpdateRate()), this);
+  marker_update_rate_property_->setMin(0.0f);
+  updateMarkerUpdateRate();
+  journal_sync_property_ = new rviz::EnumProperty(
+      "Journal Sync", "Periodically",
+      "When to flush committed annotations to disk. Syncing every commit is the safest, but slowest option.", this,
+      SLOT(updateJournalSync()), this);
+  journal_sync_property_->addOption("Every commit", AnnotationJournal::SyncEveryRecord);
+  journal_sync_property_->addOption("Periodically", AnnotationJournal::SyncPeriodically);
+  journal_sync_property_->addOption("Never", AnnotationJournal::SyncNever);
+  updateJournalSync();
+  latency_statistics_property_ =
+      new rviz::BoolProperty("Latency Statistics", false,
+                             "Measure how long point cloud handling, point analysis, fitting, saving, loading and "
+                             "marker updates take. Percentiles of the last ten seconds are shown in the status and "
+                             "published on /diagnostics every second.",
+                             this, SLOT(updateLatencyStatistics()), this);
+  tracing_property_ = new rviz::BoolProperty("Tracing", false,
+                                             "Record when the handlers of point clouds, marker interaction and "
+                                             "shortcuts run. The timeline is written as Chrome trace (for Perfetto "
+                                             "or chrome://tracing) when tracing is disabled, by shortcut and when "
+                                             "RViz exits.",
+                                             this, SLOT(updateTracing()), this);
+  tracing_property_->setDisableChildrenIfFalse(true);
+  trace_file_property_ = new FileDialogProperty("Trace File", "annotate_trace.json", "File the timeline is written to",
+                                                tracing_property_);
+  trace_file_property_->setMode(FileDialogProperty::SaveFileName);
 
   auto* automations =
       new rviz::Property("Linked Actions", QVariant(), "Configure the interaction of related actions.", this);
@@ -332,6 +681,11 @@ void AnnotateDisplay::onInitialize()
       "Shrink before commit", true, "Shrink annotation box to fit points when committing an annotation.", automations);
   auto_fit_after_predict_ = new rviz::BoolProperty(
       "Auto-fit after points change", false, "Auto-fit annotation boxes when the point cloud changes.", automations);
+  auto_fit_orientation_ = new rviz::BoolProperty("Auto-fit orientation", false,
+                                                 "Estimate the heading of annotation boxes from their points when "
+                                                 "auto-fitting them. The heading of the previous annotation of the "
+                                                 "track decides between forward and backward.",
+                                                 automations);
   pause_after_data_change_ = new rviz::BoolProperty("Pause playback after points change", false,
                                                     "Pause playback when the point cloud changes.", automations);
   play_after_commit_ = new rviz::BoolProperty("Resume playback after commit", false,
@@ -365,6 +719,15 @@ void AnnotateDisplay::onInitialize()
   auto* commit =
       new ShortcutProperty("commit annotation", "return", "Commit current annotation and save", shortcuts_property_);
   commit->createShortcut(this, render_panel, this, SLOT(commit()));
+  auto* previous_frame = new ShortcutProperty("previous frame", "Ctrl+Left", "Show the previous point cloud of the bag",
+                                              shortcuts_property_);
+  previous_frame->createShortcut(this, render_panel, this, SLOT(previousFrame()));
+  auto* next_frame =
+      new ShortcutProperty("next frame", "Ctrl+Right", "Show the next point cloud of the bag", shortcuts_property_);
+  next_frame->createShortcut(this, render_panel, this, SLOT(nextFrame()));
+  auto* write_trace = new ShortcutProperty("write trace", "Ctrl+Shift+T",
+                                           "Write the recorded timeline to the trace file", shortcuts_property_);
+  write_trace->createShortcut(this, render_panel, this, SLOT(writeTrace()));
 
   adjustView();
   expand();
@@ -430,7 +793,16 @@ void AnnotateDisplay::setTopic(const QString& topic, const QString& datatype)
   {
     topic_property_->setString(topic);
   }
-  pointcloud_subscriber_ = node_handle_.subscribe(topic.toStdString(), 10, &AnnotateDisplay::handlePointcloud, this);
+  // Clouds of an open bag are handled directly. They are published on the topic only for the point cloud display.
+  if (bag_.isOpen())
+  {
+    pointcloud_subscriber_.shutdown();
+  }
+  else
+  {
+    pointcloud_subscriber_ =
+        node_handle_.subscribe(topic.toStdString(), 10, &AnnotateDisplay::handlePointcloud, this);
+  }
   if (cloud_display_)
   {
     cloud_display_->setTopic(topic, datatype);
@@ -455,7 +827,159 @@ void AnnotateDisplay::updateLabels()
   }
   for (auto const& marker : markers_)
   {
-    marker->setLabels(labels_);
+    marker.second->setLabels(labels_);
+  }
+  journal_.appendLabels(labels_);
+  syncJournalLater();
+}
+
+void AnnotateDisplay::openBag()
+{
+  bag_playback_timer_->stop();
+  bag_.close();
+  bag_clouds_.clear();
+  bag_transforms_.clear();
+  bag_static_transforms_.clear();
+  bag_cloud_publisher_.shutdown();
+  bag_frame_property_->setHidden(true);
+
+  auto const file = bag_file_property_->getValue().toString().toStdString();
+  string error;
+  if (file.empty())
+  {
+    deleteStatusStd("Bag");
+  }
+  else if (!bag_.open(file, error))
+  {
+    setStatusStd(rviz::StatusProperty::Error, "Bag", error);
+    ROS_WARN_STREAM(error);
+  }
+  if (!bag_.isOpen())
+  {
+    updateTopic();
+    return;
+  }
+
+  // The configured topic if the bag has clouds of it, the first point cloud topic of the bag otherwise
+  auto const configured_topic = topic_property_->getTopicStd();
+  string topic;
+  for (auto const& candidate : bag_.topics())
+  {
+    if (candidate.type == "sensor_msgs/PointCloud2" && candidate.messages > 0 &&
+        (topic.empty() || candidate.name == configured_topic))
+    {
+      topic = candidate.name;
+    }
+  }
+  if (!topic.empty())
+  {
+    bag_clouds_ = bag_.messages({ topic });
+  }
+  if (bag_clouds_.empty())
+  {
+    bag_.close();
+    setStatusStd(rviz::StatusProperty::Error, "Bag", "The bag contains no point clouds");
+    updateTopic();
+    return;
+  }
+
+  bag_transforms_ = bag_.messages({ "/tf" });
+  bag_static_transforms_ = bag_.messages({ "/tf_static" });
+  transform_listener_.getTF2BufferPtr()->clear();
+  for (auto const& entry : bag_static_transforms_)
+  {
+    feedTransforms(entry, true);
+  }
+  bag_transforms_begin_ = 0;
+  bag_transforms_end_ = 0;
+  bag_cloud_publisher_ = node_handle_.advertise<sensor_msgs::PointCloud2>(topic, 1, true);
+  setTopic(QString::fromStdString(topic), "sensor_msgs/PointCloud2");
+  bag_frame_property_->setMax(int(bag_clouds_.size()) - 1);
+  bag_frame_property_->setHidden(false);
+  showBagFrame(0);
+}
+
+void AnnotateDisplay::updateBagFrame()
+{
+  auto const frame = size_t(max(0, bag_frame_property_->getInt()));
+  if (bag_.isOpen() && frame != bag_frame_ && frame < bag_clouds_.size())
+  {
+    showBagFrame(frame);
+  }
+}
+
+void AnnotateDisplay::showBagFrame(size_t frame)
+{
+  auto cloud = boost::make_shared<sensor_msgs::PointCloud2>();
+  string error;
+  if (!bag_.read(bag_clouds_[frame], *cloud, error))
+  {
+    setStatusStd(rviz::StatusProperty::Error, "Bag", error);
+    ROS_WARN_STREAM(error);
+    return;
+  }
+
+  bag_frame_ = frame;
+  bag_frame_property_->setInt(int(frame));
+  feedBagTransforms(bag_clouds_[frame].time);
+  bag_cloud_publisher_.publish(cloud);
+  stringstream stream;
+  stream << "Frame " << frame + 1 << " of " << bag_clouds_.size() << " on " << bag_.topic(bag_clouds_[frame]);
+  setStatusStd(rviz::StatusProperty::Ok, "Bag", stream.str());
+  handlePointcloud(cloud);
+}
+
+void AnnotateDisplay::feedBagTransforms(const ros::Time& time)
+{
+  // Transforms from a second before to half a second after the cloud time
+  auto const by_time = [](const BagReader::Entry& entry, const ros::Time& time) { return entry.time < time; };
+  auto const window_start = time.toSec() > 1.0 ? time - ros::Duration(1.0) : ros::Time();
+  auto const begin = size_t(lower_bound(bag_transforms_.begin(), bag_transforms_.end(), window_start, by_time) -
+                            bag_transforms_.begin());
+  auto const end = size_t(lower_bound(bag_transforms_.begin(), bag_transforms_.end(), time + ros::Duration(0.5),
+                                       by_time) -
+                          bag_transforms_.begin());
+
+  // After a jump, tf starts over with the transforms around the new time
+  if (begin < bag_transforms_begin_ || begin > bag_transforms_end_)
+  {
+    transform_listener_.getTF2BufferPtr()->clear();
+    for (auto const& entry : bag_static_transforms_)
+    {
+      feedTransforms(entry, true);
+    }
+    bag_transforms_begin_ = begin;
+    bag_transforms_end_ = begin;
+  }
+  for (; bag_transforms_end_ < end; ++bag_transforms_end_)
+  {
+    feedTransforms(bag_transforms_[bag_transforms_end_], false);
+  }
+
+  // tf drops data that is older than its cache duration (ten seconds by default) relative to the latest data
+  if (bag_transforms_end_ > 0)
+  {
+    auto const latest = bag_transforms_[bag_transforms_end_ - 1].time.toSec();
+    auto const kept = latest > 5.0 ? ros::Time(latest - 5.0) : ros::Time();
+    auto const first_kept = size_t(lower_bound(bag_transforms_.begin(), bag_transforms_.end(), kept, by_time) -
+                                   bag_transforms_.begin());
+    bag_transforms_begin_ = max(bag_transforms_begin_, first_kept);
+  }
+}
+
+void AnnotateDisplay::feedTransforms(const BagReader::Entry& entry, bool is_static)
+{
+  tf2_msgs::TFMessage message;
+  string error;
+  if (!bag_.read(entry, message, error))
+  {
+    ROS_WARN_STREAM(error);
+    return;
+  }
+  auto const buffer = transform_listener_.getTF2BufferPtr();
+  for (auto const& transform : message.transforms)
+  {
+    buffer->setTransform(transform, "bag", is_static);
   }
 }
 
@@ -464,17 +988,21 @@ void AnnotateDisplay::openFile()
   auto const file = open_file_property_->getValue().toString();
   if (!file.isEmpty())
   {
+    // Drop the feedback callbacks of the markers from the server before they go away
     server_->clear();
-    server_->applyChanges();
+    update_batcher_->flush();
     markers_.clear();
+    tracks_.clear();
+    binary_file_.reset();
+    lazy_tracks_.clear();
+    track_spans_valid_ = false;
+    track_revisions_.clear();
+    pending_transforms_.clear();
+    waiting_for_transforms_ = false;
+    resend_track_markers_ = true;
+    current_marker_ = nullptr;
     open_file_property_->setValue(QString());
-    if (load(file.toStdString()))
-    {
-      annotation_file_property_->blockSignals(true);
-      annotation_file_property_->setValue(file);
-      filename_ = file.toStdString();
-      annotation_file_property_->blockSignals(false);
-    }
+    load(file.toStdString());
   }
 }
 
@@ -482,11 +1010,7 @@ void AnnotateDisplay::updateAnnotationFile()
 {
   if (filename_.empty())
   {
-    auto const file = annotation_file_property_->getValue().toString().toStdString();
-    if (load(file))
-    {
-      filename_ = file;
-    }
+    load(annotation_file_property_->getValue().toString().toStdString());
   }
   else
   {
@@ -500,33 +1024,242 @@ void AnnotateDisplay::updateIgnoreGround()
   auto const ignore_ground = ignore_ground_property_->getBool();
   for (auto const& marker : markers_)
   {
-    marker->setIgnoreGround(ignore_ground);
+    marker.second->setIgnoreGround(ignore_ground);
   }
+  updateSpatialIndex();
 }
 
-bool AnnotateDisplay::load(string const& file)
+void AnnotateDisplay::updateSpatialIndex()
 {
-  using namespace YAML;
-  Node node;
-  try
+  if (cloud_cache_)
   {
-    node = LoadFile(file);
+    auto const indexed = internal::indexCloud(cloud_cache_, SpatialIndex::Type(spatial_index_property_->getOptionInt()),
+                                              ignore_ground_property_->getBool());
+    spatial_index_ = indexed.first;
+    ground_model_ = indexed.second;
   }
-  catch (Exception const& e)
+}
+
+void AnnotateDisplay::updateMarkerUpdateRate()
+{
+  update_batcher_->setMaximumRate(marker_update_rate_property_->getFloat());
+}
+
+void AnnotateDisplay::updateLatencyStatistics()
+{
+  latency_monitor_.clear();
+  if (latency_statistics_property_->getBool())
   {
+    diagnostics_publisher_ = node_handle_.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 10);
+    latency_monitor_.setEnabled(true);
+    latency_timer_->start();
+  }
+  else
+  {
+    latency_monitor_.setEnabled(false);
+    latency_timer_->stop();
+    diagnostics_publisher_.shutdown();
+    deleteStatusStd("Latency");
+  }
+}
+
+void AnnotateDisplay::publishLatencyStatistics()
+{
+  latency_monitor_.advance();
+  diagnostic_msgs::DiagnosticArray message;
+  message.header.stamp = ros::Time::now();
+  stringstream summary;
+  summary << fixed << setprecision(1);
+  for (int i = 0; i < LatencyMonitor::Sections; ++i)
+  {
+    auto const section = LatencyMonitor::Section(i);
+    auto const statistics = latency_monitor_.statistics(section);
+    auto const name = LatencyMonitor::name(section);
+    diagnostic_msgs::DiagnosticStatus status;
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.name = "annotate: " + name;
     stringstream stream;
-    stream << "Failed to open " << file << ": " << e.msg;
-    ROS_DEBUG_STREAM(stream.str());
-    setStatusStd(rviz::StatusProperty::Error, "Annotation File", stream.str());
-    return false;
+    stream << fixed << setprecision(3);
+    stream << statistics.count << " calls, p50 " << statistics.p50 * 1e3 << " ms, p95 " << statistics.p95 * 1e3
+           << " ms, p99 " << statistics.p99 * 1e3 << " ms";
+    status.message = stream.str();
+    auto const add = [&status](const string& key, const string& value) {
+      diagnostic_msgs::KeyValue key_value;
+      key_value.key = key;
+      key_value.value = value;
+      status.values.push_back(key_value);
+    };
+    add("count", to_string(statistics.count));
+    add("p50 [ms]", to_string(statistics.p50 * 1e3));
+    add("p95 [ms]", to_string(statistics.p95 * 1e3));
+    add("p99 [ms]", to_string(statistics.p99 * 1e3));
+    add("max [ms]", to_string(statistics.maximum * 1e3));
+    message.status.push_back(status);
+
+    if (statistics.count > 0)
+    {
+      summary << (summary.tellp() > 0 ? "; " : "") << name << " " << statistics.p50 * 1e3 << " / "
+              << statistics.p95 * 1e3 << " / " << statistics.p99 * 1e3 << " ms";
+    }
   }
-  labels_.clear();
-  Node labels = node["labels"];
+  diagnostics_publisher_.publish(message);
+  setStatusStd(rviz::StatusProperty::Ok, "Latency",
+               summary.tellp() > 0 ? "p50 / p95 / p99: " + summary.str() : "No calls in the last ten seconds");
+}
+
+void AnnotateDisplay::updateTracing()
+{
+  if (tracing_property_->getBool())
+  {
+    trace_recorder_.setThreadName("GUI");
+    trace_recorder_.setEnabled(true);
+  }
+  else
+  {
+    trace_recorder_.setEnabled(false);
+    writeTrace();
+  }
+}
+
+void AnnotateDisplay::writeTrace()
+{
+  if (trace_recorder_.events() == 0)
+  {
+    return;
+  }
+
+  auto const file = trace_file_property_->getValue().toString().toStdString();
+  string error;
+  if (!trace_recorder_.write(file, error))
+  {
+    setStatusStd(rviz::StatusProperty::Error, "Trace", error);
+    ROS_WARN_STREAM(error);
+    return;
+  }
+  stringstream stream;
+  stream << "Wrote " << trace_recorder_.events() << " events to " << file;
+  setStatusStd(rviz::StatusProperty::Ok, "Trace", stream.str());
+}
+
+void AnnotateDisplay::updateJournalSync()
+{
+  journal_.setSyncPolicy(AnnotationJournal::SyncPolicy(journal_sync_property_->getOptionInt()));
+  syncJournalLater();
+}
+
+void AnnotateDisplay::syncJournalLater()
+{
+  // The journal syncs periodic records only when appending the next one. Make sure the last ones do not wait for it.
+  if (journal_.unsynced() && journal_sync_property_ &&
+      journal_sync_property_->getOptionInt() == AnnotationJournal::SyncPeriodically && !journal_sync_timer_->isActive())
+  {
+    journal_sync_timer_->start();
+  }
+}
+
+void AnnotateDisplay::syncJournal()
+{
+  journal_.sync();
+}
+
+void AnnotateDisplay::load(string const& file)
+{
+  if (loading_.valid())
+  {
+    // Superseded by this one
+    loading_.get();
+  }
+  finishCompaction();
+  journal_.close();
+  setStatusStd(rviz::StatusProperty::Ok, "Annotation File", "Loading " + file);
+
+  // Files are read on a separate thread such that the worker pool is free to parse them. Only the creation of
+  // markers is left to the GUI thread.
+  loading_ = async(launch::async, [this, file]() {
+    LatencyMonitor::Timer timer(latency_monitor_, LatencyMonitor::Load);
+    LoadedFile loaded;
+    loaded.file = file;
+    if (isBinaryAnnotationFile(file))
+    {
+      // Binary files stay mapped and their tracks are decoded when first needed. Only tracks with journal records
+      // are decoded right away such that the records can be applied to them.
+      auto binary = make_shared<BinaryAnnotationFile>();
+      loaded.success = binary->open(file, loaded.error);
+      if (loaded.success)
+      {
+        loaded.data.labels = binary->labels();
+        loaded.replayed = AnnotationJournal::replay(file, loaded.data);
+        for (size_t i = 0; i < binary->tracks(); ++i)
+        {
+          auto const& span = binary->track(i);
+          if (span.begin < span.end)
+          {
+            loaded.lazy_tracks[int(span.id)] = i;
+          }
+        }
+        for (auto& track : loaded.data.tracks)
+        {
+          auto const lazy = loaded.lazy_tracks.find(int(track.id));
+          if (lazy != loaded.lazy_tracks.end())
+          {
+            auto merged = binary->trackInstances(lazy->second);
+            for (auto const& instance : track.track)
+            {
+              merged.insert(instance);
+            }
+            track.track = move(merged);
+            loaded.lazy_tracks.erase(lazy);
+          }
+        }
+        loaded.binary = binary;
+      }
+    }
+    else
+    {
+      loaded.success = readAnnotations(file, loaded.data, loaded.error, worker_pool_, [this](double progress) {
+        QMetaObject::invokeMethod(this, "updateLoadProgress", Qt::QueuedConnection,
+                                  Q_ARG(int, int(100 * progress)));
+      });
+      if (loaded.success)
+      {
+        loaded.replayed = AnnotationJournal::replay(file, loaded.data);
+      }
+    }
+    QMetaObject::invokeMethod(this, "finishLoading", Qt::QueuedConnection);
+    return loaded;
+  });
+}
+
+void AnnotateDisplay::updateLoadProgress(int percent)
+{
+  if (loading_.valid())
+  {
+    stringstream stream;
+    stream << "Loading annotations: " << percent << " %";
+    setStatusStd(rviz::StatusProperty::Ok, "Annotation File", stream.str());
+  }
+}
+
+void AnnotateDisplay::finishLoading()
+{
+  if (!loading_.valid() || loading_.wait_for(chrono::seconds(0)) != future_status::ready)
+  {
+    return;
+  }
+
+  auto const loaded = loading_.get();
+  if (!loaded.success)
+  {
+    ROS_DEBUG_STREAM(loaded.error);
+    setStatusStd(rviz::StatusProperty::Error, "Annotation File", loaded.error);
+    return;
+  }
+
+  auto const& data = loaded.data;
+  labels_ = data.labels;
   string joined_labels;
-  for (size_t i = 0; i < labels.size(); ++i)
+  for (auto const& value : labels_)
   {
-    auto const value = labels[i].as<string>();
-    labels_.push_back(value);
     if (joined_labels.empty())
     {
       joined_labels = value;
@@ -537,179 +1270,320 @@ bool AnnotateDisplay::load(string const& file)
     }
   }
   labels_property_->setStdString(joined_labels);
-  Node tracks = node["tracks"];
-  size_t annotations = 0;
-  for (size_t i = 0; i < tracks.size(); ++i)
-  {
-    Track track;
-    Node annotation = tracks[i];
-    auto const id = annotation["id"].as<size_t>();
-    Node t = annotation["track"];
-    for (size_t j = 0; j < t.size(); ++j)
-    {
-      Node inst = t[j];
-      TrackInstance instance;
-      instance.label = inst["label"].as<string>();
-
-      Node header = inst["header"];
-      instance.center.frame_id_ = header["frame_id"].as<string>();
-      instance.center.stamp_.sec = header["stamp"]["secs"].as<uint32_t>();
-      instance.center.stamp_.nsec = header["stamp"]["nsecs"].as<uint32_t>();
 
-      Node origin = inst["translation"];
-      instance.center.setOrigin({ origin["x"].as<double>(), origin["y"].as<double>(), origin["z"].as<double>() });
-      Node rotation = inst["rotation"];
-      instance.center.setRotation({ rotation["x"].as<double>(), rotation["y"].as<double>(), rotation["z"].as<double>(),
-                                    rotation["w"].as<double>() });
-
-      Node box = inst["box"];
-      instance.box_size.setX(box["length"].as<double>());
-      instance.box_size.setY(box["width"].as<double>());
-      instance.box_size.setZ(box["height"].as<double>());
-
-      track.push_back(instance);
-      ++annotations;
-    }
-
-    if (!track.empty())
+  for (auto const& track : data.tracks)
+  {
+    if (!track.track.empty())
     {
-      current_marker_id_ = max(current_marker_id_, id);
-      auto marker = make_shared<AnnotationMarker>(this, server_, track.front(), id);
-      marker->setLabels(labels_);
-      marker->setTrack(track);
-      bool ignore_ground = ignore_ground_property_ ? ignore_ground_property_->getBool() : false;
-      marker->setIgnoreGround(ignore_ground);
-      marker->setTime(time_);
-      markers_.push_back(marker);
+      current_marker_id_ = max(current_marker_id_, track.id);
+      tracks_[int(track.id)] = track.track;
     }
   }
+  binary_file_ = loaded.binary;
+  lazy_tracks_ = loaded.lazy_tracks;
+  size_t annotations = data.annotations();
+  for (auto const& track : lazy_tracks_)
+  {
+    current_marker_id_ = max(current_marker_id_, size_t(track.first));
+    tracks_.erase(track.first);
+    auto const& span = binary_file_->track(track.second);
+    annotations += span.end - span.begin;
+  }
+  track_spans_valid_ = false;
+  resend_track_markers_ = true;
+  updateActiveMarkers();
+  for (auto const& marker : markers_)
+  {
+    marker.second->setTime(time_);
+  }
+
+  filename_ = loaded.file;
+  annotation_file_property_->blockSignals(true);
+  annotation_file_property_->setValue(QString::fromStdString(filename_));
+  annotation_file_property_->blockSignals(false);
+  journal_.open(filename_, false);
+
   stringstream stream;
-  stream << "Loaded " << markers_.size() << " tracks with " << annotations << " annotations";
+  stream << "Loaded " << tracks_.size() + lazy_tracks_.size() << " tracks with " << annotations << " annotations";
+  if (loaded.replayed > 0)
+  {
+    stream << ", recovered " << loaded.replayed << " journal records";
+    compactJournal();
+  }
   setStatusStd(rviz::StatusProperty::Ok, "Annotation File", stream.str());
   publishTrackMarkers();
-  return true;
+}
+
+AnnotationData AnnotateDisplay::annotationData() const
+{
+  // Tracks not decoded from binary_file_ yet are left to the caller
+  AnnotationData data;
+  data.labels = labels_;
+  data.tracks.reserve(tracks_.size());
+  for (auto const& entry : tracks_)
+  {
+    AnnotationTrack track;
+    track.id = size_t(entry.first);
+    track.track = entry.second;
+    data.tracks.push_back(track);
+  }
+  return data;
 }
 
 bool AnnotateDisplay::save()
 {
-  using namespace YAML;
-  Node node;
-  size_t annotations = 0;
-  for (auto const& label : labels_)
+  if (loading_.valid())
   {
-    node["labels"].push_back(label);
+    setStatusStd(rviz::StatusProperty::Warn, "Annotation File", "Annotations cannot be saved while loading a file");
+    return false;
   }
-  for (auto const& marker : markers_)
+  LatencyMonitor::Timer timer(latency_monitor_, LatencyMonitor::Save);
+  TraceRecorder::Scope scope(trace_recorder_, "save");
+  finishCompaction();
+  auto data = annotationData();
+  if (binary_file_)
   {
-    Node annotation;
-    annotation["id"] = marker->id();
-    for (auto const& instance : marker->track())
-    {
-      Node i;
-      i["label"] = instance.label;
-
-      Node header;
-      header["frame_id"] = instance.center.frame_id_;
-      Node stamp;
-      stamp["secs"] = instance.center.stamp_.sec;
-      stamp["nsecs"] = instance.center.stamp_.nsec;
-      header["stamp"] = stamp;
-      i["header"] = header;
+    internal::addTracks(*binary_file_, lazy_tracks_, data);
+  }
+  string error;
+  if (!writeAnnotations(filename_, data, error))
+  {
+    setStatusStd(rviz::StatusProperty::Error, "Annotation File", error);
+    ROS_WARN_STREAM(error);
+    return false;
+  }
 
-      Node origin;
-      auto const o = instance.center.getOrigin();
-      origin["x"] = o.x();
-      origin["y"] = o.y();
-      origin["z"] = o.z();
-      i["translation"] = origin;
+  // The annotation file contains everything now, start over with an empty journal
+  journal_.open(filename_, true);
+  stringstream status_stream;
+  status_stream << "Saved " << data.tracks.size() << " tracks with " << data.annotations() << " annotations";
+  setStatusStd(rviz::StatusProperty::Ok, "Annotation File", status_stream.str());
+  return true;
+}
 
-      Node rotation;
-      auto const q = instance.center.getRotation();
-      rotation["x"] = q.x();
-      rotation["y"] = q.y();
-      rotation["z"] = q.z();
-      rotation["w"] = q.w();
-      i["rotation"] = rotation;
+bool AnnotateDisplay::saveInstance(int id, const TrackInstance& instance)
+{
+  auto& track = this->track(id);
+  auto const stamp = instance.center.stamp_;
+  if (track.empty() || stamp < track.front().center.stamp_ || stamp > track.back().center.stamp_)
+  {
+    track_spans_valid_ = false;
+  }
+  track.insert(instance);
+  ++track_revisions_[id];
+  if (!journal_.isOpen() || !journal_.append(size_t(id), instance))
+  {
+    return save();
+  }
 
-      Node box;
-      box["length"] = instance.box_size.x();
-      box["width"] = instance.box_size.y();
-      box["height"] = instance.box_size.z();
-      i["box"] = box;
+  syncJournalLater();
+  stringstream status_stream;
+  status_stream << "Saved annotation of track " << id << " at " << instance.center.stamp_ << " to the journal";
+  setStatusStd(rviz::StatusProperty::Ok, "Annotation File", status_stream.str());
+  if (journal_.records() >= internal::compaction_threshold)
+  {
+    compactJournal();
+  }
+  return true;
+}
 
-      annotation["track"].push_back(i);
-      ++annotations;
-    }
-    node["tracks"].push_back(annotation);
+void AnnotateDisplay::compactJournal()
+{
+  if (compaction_.valid() || filename_.empty() || !journal_.isOpen() || journal_.records() == 0)
+  {
+    return;
   }
 
-  ofstream stream(filename_);
-  if (stream.is_open())
+  // The snapshot is taken before rotating such that it contains every record moved aside
+  auto data = annotationData();
+  if (!journal_.rotate())
   {
-    stream << node;
-    if (stream.bad())
+    ROS_WARN_STREAM("Failed to rotate the annotation journal of " << filename_);
+    return;
+  }
+
+  // Tracks still in the binary file are decoded by the worker. Replacing the file keeps its old contents mapped.
+  auto const file = filename_;
+  auto const binary = binary_file_;
+  auto const lazy_tracks = lazy_tracks_;
+  compaction_ = worker_pool_.submit([this, file, data, binary, lazy_tracks]() mutable {
+    if (binary)
     {
-      stringstream status_stream;
-      status_stream << "Failed to write annotations to " << filename_;
-      setStatusStd(rviz::StatusProperty::Error, "Annotation File", status_stream.str());
-      ROS_WARN_STREAM(status_stream.str());
-      return false;
+      internal::addTracks(*binary, lazy_tracks, data);
     }
+    string error;
+    writeAnnotations(file, data, error);
+    QMetaObject::invokeMethod(this, "finishCompaction", Qt::QueuedConnection);
+    return error;
+  });
+}
+
+void AnnotateDisplay::finishCompaction()
+{
+  if (!compaction_.valid())
+  {
+    return;
+  }
+
+  auto const error = compaction_.get();
+  if (error.empty())
+  {
+    journal_.removeRotated();
   }
   else
   {
-    stringstream status_stream;
-    status_stream << "Failed to open " << filename_ << " for writing. Annotations will not be saved.";
-    setStatusStd(rviz::StatusProperty::Error, "Annotation File", status_stream.str());
-    ROS_WARN_STREAM(status_stream.str());
-    return false;
+    // The rotated journal is kept and replayed on the next load or folded into the next compaction
+    setStatusStd(rviz::StatusProperty::Warn, "Annotation File", error);
+    ROS_WARN_STREAM(error);
   }
-  stream.close();
-  stringstream status_stream;
-  status_stream << "Saved " << markers_.size() << " tracks with " << annotations << " annotations";
-  setStatusStd(rviz::StatusProperty::Ok, "Annotation File", status_stream.str());
-  return true;
 }
 
 void AnnotateDisplay::publishTrackMarkers()
 {
-  visualization_msgs::MarkerArray message;
-
-  Marker delete_all;
-  delete_all.action = Marker::DELETEALL;
-  message.markers.push_back(delete_all);
+  LatencyMonitor::Timer timer(latency_monitor_, LatencyMonitor::PublishTrackMarkers);
+  // Markers are reused between calls to keep the memory of their points. next() returns the index of the next
+  // marker, because adding markers moves the existing ones and invalidates references to them.
+  auto& markers = track_message_.markers;
+  auto& spare = spare_track_markers_;
+  size_t used = 0;
+  auto const next = [&markers, &spare, &used]() {
+    if (used == markers.size())
+    {
+      if (spare.empty())
+      {
+        markers.emplace_back();
+      }
+      else
+      {
+        markers.push_back(move(spare.back()));
+        spare.pop_back();
+      }
+    }
+    return used++;
+  };
 
-  for (auto const& marker : markers_)
+  if (resend_track_markers_)
   {
-    auto const color = internal::createColor(marker->id());
-    Marker line = internal::createTrackLine(0.02, color);
-    line.id = marker->id();
-    line.ns = "Path";
-    Marker dots = internal::createTrackSpheres(0.1, color);
-    dots.id = marker->id() << 16;
-    dots.ns = "Positions";
+    published_paths_.clear();
+    auto& delete_all = markers[next()];
+    delete_all = Marker();
+    delete_all.action = Marker::DELETEALL;
+    resend_track_markers_ = false;
+  }
 
-    for (auto const& instance : marker->track())
+  // Only tracks with instances in the last five seconds have a path
+  double const window = 5.0;
+  auto const window_start = time_.toSec() > window ? time_ - ros::Duration(window) : ros::Time();
+  vector<int> ids;
+  trackSpans().query(window_start.toSec(), time_.toSec(), ids);
+  sort(ids.begin(), ids.end());
+
+  // Tracks not decoded yet are looked up in the time index of the binary file, which decodes only the instances
+  // within the window
+  map<int, vector<TrackInstance>> lazy_instances;
+  if (binary_file_ && !lazy_tracks_.empty())
+  {
+    vector<uint64_t> indices;
+    binary_file_->query(window_start, time_, indices);
+    for (auto const index : indices)
     {
-      if (instance.center.stamp_ <= time_ && instance.timeTo(time_) <= 5.0)
+      auto const id = int(binary_file_->trackId(index));
+      if (lazy_tracks_.find(id) != lazy_tracks_.end())
       {
-        geometry_msgs::Point point;
-        auto const p = instance.center.getOrigin();
-        pointTFToMsg(p, point);
-        line.points.push_back(point);
-        line.header.frame_id = instance.center.frame_id_;
-        dots.points.push_back(point);
-        dots.header.frame_id = instance.center.frame_id_;
+        lazy_instances[id].push_back(binary_file_->instance(index));
       }
     }
+  }
+
+  map<int, PublishedPath> paths;
+  for (auto const id : ids)
+  {
+    auto const lazy = lazy_instances.find(id);
+    auto const track = tracks_.find(id);
+    if (lazy == lazy_instances.end() && track == tracks_.end())
+    {
+      continue;
+    }
+    auto const range = lazy != lazy_instances.end() ? make_pair(lazy->second.cbegin(), lazy->second.cend()) :
+                                                      track->second.range(window_start, time_);
+    if (range.first == range.second)
+    {
+      continue;
+    }
+
+    PublishedPath path;
+    path.first = range.first->center.stamp_;
+    path.last = (range.second - 1)->center.stamp_;
+    path.size = size_t(range.second - range.first);
+    auto const revision = track_revisions_.find(id);
+    path.revision = revision == track_revisions_.end() ? 0 : revision->second;
+    paths[id] = path;
+
+    auto const published = published_paths_.find(id);
+    if (published != published_paths_.end() && published->second == path)
+    {
+      continue;
+    }
 
+    // Adding an existing marker again modifies it
+    auto const color = internal::createColor(id);
+    auto const line_index = next();
+    auto const dots_index = next();
+    auto& line = markers[line_index];
+    internal::initTrackLine(line, 0.02, color);
+    line.id = id;
+    line.ns = "Path";
+    auto& dots = markers[dots_index];
+    internal::initTrackSpheres(dots, 0.1, color);
+    dots.id = id << 16;
+    dots.ns = "Positions";
+    for (auto instance = range.first; instance != range.second; ++instance)
+    {
+      geometry_msgs::Point point;
+      auto const p = instance->center.getOrigin();
+      pointTFToMsg(p, point);
+      line.points.push_back(point);
+      line.header.frame_id = instance->center.frame_id_;
+      dots.points.push_back(point);
+      dots.header.frame_id = instance->center.frame_id_;
+    }
     line.action = line.points.size() < 2 ? Marker::DELETE : Marker::ADD;
-    message.markers.push_back(line);
-    dots.action = dots.points.empty() ? Marker::DELETE : Marker::ADD;
-    message.markers.push_back(dots);
+    dots.action = Marker::ADD;
   }
 
-  track_marker_publisher_.publish(message);
+  // Paths that left the time window
+  for (auto const& published : published_paths_)
+  {
+    if (paths.find(published.first) == paths.end())
+    {
+      auto const line_index = next();
+      auto const dots_index = next();
+      auto& line = markers[line_index];
+      line.points.clear();
+      line.ns = "Path";
+      line.id = published.first;
+      line.action = Marker::DELETE;
+      auto& dots = markers[dots_index];
+      dots.points.clear();
+      dots.ns = "Positions";
+      dots.id = published.first << 16;
+      dots.action = Marker::DELETE;
+    }
+  }
+
+  published_paths_.swap(paths);
+  move(markers.begin() + used, markers.end(), back_inserter(spare));
+  markers.erase(markers.begin() + used, markers.end());
+  if (!markers.empty())
+  {
+    track_marker_publisher_.publish(track_message_);
+  }
+}
+
+void AnnotateDisplay::resendTrackMarkers(const ros::SingleSubscriberPublisher& /*publisher*/)
+{
+  resend_track_markers_ = true;
+  publishTrackMarkers();
 }
 
 sensor_msgs::PointCloud2ConstPtr AnnotateDisplay::cloud() const
@@ -717,16 +1591,213 @@ sensor_msgs::PointCloud2ConstPtr AnnotateDisplay::cloud() const
   return cloud_;
 }
 
+CloudCache::Ptr AnnotateDisplay::cloudCache() const
+{
+  return cloud_cache_;
+}
+
+SpatialIndex::Ptr AnnotateDisplay::spatialIndex() const
+{
+  return spatial_index_;
+}
+
+GroundModel::Ptr AnnotateDisplay::groundModel() const
+{
+  return ground_model_;
+}
+
 TransformListener& AnnotateDisplay::transformListener()
 {
   return transform_listener_;
 }
 
+bool AnnotateDisplay::cloudTransform(int marker_id, const string& frame, const ros::Time& time,
+                                     StampedTransform& transform)
+{
+  if (!cloud_cache_)
+  {
+    return false;
+  }
+
+  auto const stamp = min(time, cloud_cache_->stamp());
+  auto const& cloud_frame = cloud_cache_->frameId();
+  auto pending = pending_transforms_.find(marker_id);
+  auto const key = make_tuple(cloud_frame, frame, stamp);
+  auto const cached = transform_cache_.find(key);
+  if (cached != transform_cache_.end())
+  {
+    ++transform_cache_hits_;
+    transform = cached->second;
+    if (pending != pending_transforms_.end())
+    {
+      pending_transforms_.erase(pending);
+    }
+    return true;
+  }
+
+  ++transform_cache_misses_;
+  if (transform_listener_.canTransform(frame, cloud_frame, stamp))
+  {
+    transform_listener_.lookupTransform(frame, cloud_frame, stamp, transform);
+    transform_cache_[key] = transform;
+    if (pending != pending_transforms_.end())
+    {
+      pending_transforms_.erase(pending);
+    }
+    return true;
+  }
+
+  auto const now = chrono::steady_clock::now();
+  if (pending == pending_transforms_.end() || pending->second.frame != frame || pending->second.stamp != stamp)
+  {
+    pending_transforms_[marker_id] = { frame, stamp, now };
+    waiting_for_transforms_ = true;
+    if (!pending_transform_timer_->isActive())
+    {
+      pending_transform_timer_->start(internal::transform_timeout.count());
+    }
+    return false;
+  }
+  if (now - pending->second.requested < internal::transform_timeout)
+  {
+    return false;
+  }
+
+  pending_transforms_.erase(pending);
+  string error;
+  if (!transform_listener_.canTransform(frame, cloud_frame, ros::Time(), &error))
+  {
+    ROS_WARN_STREAM("Transformation failed: " << error);
+    return false;
+  }
+  transform_listener_.lookupTransform(frame, cloud_frame, ros::Time(), transform);
+  return true;
+}
+
+size_t AnnotateDisplay::transformCacheHits() const
+{
+  return transform_cache_hits_;
+}
+
+size_t AnnotateDisplay::transformCacheMisses() const
+{
+  return transform_cache_misses_;
+}
+
+void AnnotateDisplay::notifyTransformsChanged()
+{
+  // Called from the tf listener thread for every incoming message. Post at most one check to the GUI thread.
+  if (waiting_for_transforms_ && !transforms_changed_.exchange(true))
+  {
+    QMetaObject::invokeMethod(this, "processPendingTransforms", Qt::QueuedConnection);
+  }
+}
+
+void AnnotateDisplay::processPendingTransforms()
+{
+  transforms_changed_ = false;
+  if (!cloud_cache_)
+  {
+    pending_transforms_.clear();
+  }
+
+  auto const now = chrono::steady_clock::now();
+  vector<int> ready;
+  for (auto const& pending : pending_transforms_)
+  {
+    if (now - pending.second.requested >= internal::transform_timeout ||
+        transform_listener_.canTransform(pending.second.frame, cloud_cache_->frameId(), pending.second.stamp))
+    {
+      ready.push_back(pending.first);
+    }
+  }
+
+  for (auto const id : ready)
+  {
+    auto const marker = markers_.find(id);
+    if (marker != markers_.end())
+    {
+      marker->second->updateCloudTransform();
+    }
+    pending_transforms_.erase(id);
+  }
+  if (!ready.empty())
+  {
+    scheduleServerUpdate();
+  }
+
+  waiting_for_transforms_ = !pending_transforms_.empty();
+  if (!pending_transforms_.empty())
+  {
+    auto next = pending_transforms_.begin()->second.requested;
+    for (auto const& pending : pending_transforms_)
+    {
+      next = min(next, pending.second.requested);
+    }
+    auto const remaining = chrono::duration_cast<chrono::milliseconds>(next + internal::transform_timeout - now);
+    pending_transform_timer_->start(max<int>(1, remaining.count()));
+  }
+}
+
+void AnnotateDisplay::fitInBackground(function<AnnotationMarker::FitResult()> fit)
+{
+  worker_pool_.submit([this, fit]() {
+    auto const result = fit();
+    {
+      lock_guard<mutex> lock(fit_results_mutex_);
+      fit_results_.push_back(result);
+    }
+    QMetaObject::invokeMethod(this, "applyFitResults", Qt::QueuedConnection);
+  });
+}
+
+void AnnotateDisplay::applyFitResults()
+{
+  vector<AnnotationMarker::FitResult> results;
+  {
+    lock_guard<mutex> lock(fit_results_mutex_);
+    results.swap(fit_results_);
+  }
+
+  for (auto const& result : results)
+  {
+    auto const marker = markers_.find(result.marker_id);
+    if (marker != markers_.end())
+    {
+      marker->second->applyFit(result);
+    }
+  }
+  if (!results.empty())
+  {
+    scheduleServerUpdate();
+  }
+}
+
+void AnnotateDisplay::scheduleServerUpdate()
+{
+  update_batcher_->schedule();
+}
+
 void AnnotateDisplay::setCurrentMarker(AnnotationMarker* marker)
 {
   current_marker_ = marker;
 }
 
+LatencyMonitor& AnnotateDisplay::latencyMonitor()
+{
+  return latency_monitor_;
+}
+
+TraceRecorder& AnnotateDisplay::traceRecorder()
+{
+  return trace_recorder_;
+}
+
+int64_t AnnotateDisplay::currentMarkerId() const
+{
+  return current_marker_ ? current_marker_->id() : -1;
+}
+
 bool AnnotateDisplay::shrinkAfterResize() const
 {
   return shrink_after_resize_ && shrink_after_resize_->getBool();
@@ -742,6 +1813,11 @@ bool AnnotateDisplay::autoFitAfterPredict() const
   return auto_fit_after_predict_ && auto_fit_after_predict_->getBool();
 }
 
+bool AnnotateDisplay::autoFitOrientation() const
+{
+  return auto_fit_orientation_ && auto_fit_orientation_->getBool();
+}
+
 }  // namespace annotate
 
 #include <pluginlib/class_list_macros.h>
@@ -0,0 +1,437 @@
+#include <annotate/annotation_binary.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <numeric>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace annotate
+{
+namespace internal
+{
+char const binary_magic[8] = { 'A', 'N', 'N', 'O', 'T', 'B', 'I', 'N' };
+uint32_t const binary_version = 1;
+
+enum BinarySection
+{
+  TrackSpans,
+  TrackIds,
+  Stamps,
+  Translations,
+  Rotations,
+  BoxSizes,
+  LabelIds,
+  FrameIds,
+  TimeIndex,
+  FileLabels,
+  InstanceLabels,
+  Frames,
+  SectionCount
+};
+
+struct BinaryHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t sections;
+  uint64_t instances;
+  uint64_t tracks;
+  uint64_t offset[SectionCount];
+  uint64_t size[SectionCount];
+};
+
+/** Bytes per instance (or track) of each column. Zero for variable-sized text sections. */
+size_t const element_size[SectionCount] = { sizeof(BinaryAnnotationFile::TrackSpan),
+                                            sizeof(uint64_t),
+                                            sizeof(uint64_t),
+                                            3 * sizeof(double),
+                                            4 * sizeof(double),
+                                            3 * sizeof(double),
+                                            sizeof(uint32_t),
+                                            sizeof(uint32_t),
+                                            sizeof(uint64_t),
+                                            0,
+                                            0,
+                                            0 };
+
+/**
+ * Text sections store the number of strings, followed by count + 1 offsets into the concatenated characters
+ */
+string encodeTexts(const vector<string>& texts)
+{
+  uint64_t const count = texts.size();
+  vector<uint64_t> offsets(1, 0);
+  for (auto const& text : texts)
+  {
+    offsets.push_back(offsets.back() + text.size());
+  }
+  string result(reinterpret_cast<const char*>(&count), sizeof(count));
+  result.append(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+  for (auto const& text : texts)
+  {
+    result += text;
+  }
+  return result;
+}
+
+uint32_t textId(const string& text, map<string, uint32_t>& ids, vector<string>& texts)
+{
+  auto const iter = ids.find(text);
+  if (iter != ids.end())
+  {
+    return iter->second;
+  }
+  auto const id = uint32_t(texts.size());
+  ids[text] = id;
+  texts.push_back(text);
+  return id;
+}
+
+}  // namespace internal
+
+BinaryAnnotationFile::~BinaryAnnotationFile()
+{
+  close();
+}
+
+bool BinaryAnnotationFile::open(const string& file, string& error)
+{
+  using namespace internal;
+  close();
+
+  auto const fail = [&](const string& message) {
+    close();
+    stringstream stream;
+    stream << "Failed to open " << file << ": " << message;
+    error = stream.str();
+    return false;
+  };
+
+  int const descriptor = ::open(file.c_str(), O_RDONLY);
+  if (descriptor < 0)
+  {
+    return fail(strerror(errno));
+  }
+  struct stat status;
+  if (fstat(descriptor, &status) != 0 || size_t(status.st_size) < sizeof(BinaryHeader))
+  {
+    ::close(descriptor);
+    return fail("Not a binary annotation file");
+  }
+  size_ = size_t(status.st_size);
+  void* mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, descriptor, 0);
+  ::close(descriptor);
+  if (mapping == MAP_FAILED)
+  {
+    return fail(strerror(errno));
+  }
+  mapping_ = mapping;
+
+  auto const& header = *static_cast<const BinaryHeader*>(mapping_);
+  if (memcmp(header.magic, binary_magic, sizeof(binary_magic)) != 0)
+  {
+    return fail("Not a binary annotation file");
+  }
+  if (header.version != binary_version || header.sections != SectionCount)
+  {
+    return fail("Unsupported version or byte order");
+  }
+
+  for (size_t i = 0; i < SectionCount; ++i)
+  {
+    auto const offset = header.offset[i];
+    auto const size = header.size[i];
+    if (offset % sizeof(uint64_t) != 0 || offset > size_ || size > size_ - offset)
+    {
+      return fail("Truncated or corrupt file");
+    }
+    auto const count = i == TrackSpans ? header.tracks : header.instances;
+    if (element_size[i] > 0 && (count > size / element_size[i] || size != count * element_size[i]))
+    {
+      return fail("Truncated or corrupt file");
+    }
+    if (element_size[i] == 0)
+    {
+      auto const strings = size < sizeof(uint64_t) ? 0 : *reinterpret_cast<const uint64_t*>(
+                                                             static_cast<const char*>(mapping_) + offset);
+      if (size < sizeof(uint64_t) || strings > size / sizeof(uint64_t) || (strings + 2) * sizeof(uint64_t) > size)
+      {
+        return fail("Truncated or corrupt file");
+      }
+    }
+  }
+
+  instances_ = header.instances;
+  tracks_ = header.tracks;
+  return true;
+}
+
+void BinaryAnnotationFile::close()
+{
+  if (mapping_)
+  {
+    munmap(mapping_, size_);
+    mapping_ = nullptr;
+  }
+  size_ = 0;
+  instances_ = 0;
+  tracks_ = 0;
+}
+
+bool BinaryAnnotationFile::isOpen() const
+{
+  return mapping_ != nullptr;
+}
+
+template <class T>
+const T* BinaryAnnotationFile::column(size_t section) const
+{
+  auto const& header = *static_cast<const internal::BinaryHeader*>(mapping_);
+  return reinterpret_cast<const T*>(static_cast<const char*>(mapping_) + header.offset[section]);
+}
+
+size_t BinaryAnnotationFile::texts(size_t section) const
+{
+  return *column<uint64_t>(section);
+}
+
+string BinaryAnnotationFile::text(size_t section, size_t index) const
+{
+  auto const& header = *static_cast<const internal::BinaryHeader*>(mapping_);
+  auto const count = texts(section);
+  if (index >= count)
+  {
+    return string();
+  }
+  auto const* offsets = column<uint64_t>(section) + 1;
+  auto const characters = (count + 2) * sizeof(uint64_t);
+  auto const begin = offsets[index];
+  auto const end = offsets[index + 1];
+  if (begin > end || end > header.size[section] - characters)
+  {
+    return string();
+  }
+  return string(column<char>(section) + characters + begin, end - begin);
+}
+
+vector<string> BinaryAnnotationFile::labels() const
+{
+  vector<string> result;
+  for (size_t i = 0; i < texts(internal::FileLabels); ++i)
+  {
+    result.push_back(text(internal::FileLabels, i));
+  }
+  return result;
+}
+
+size_t BinaryAnnotationFile::tracks() const
+{
+  return tracks_;
+}
+
+const BinaryAnnotationFile::TrackSpan& BinaryAnnotationFile::track(size_t index) const
+{
+  return column<TrackSpan>(internal::TrackSpans)[index];
+}
+
+Track BinaryAnnotationFile::trackInstances(size_t index) const
+{
+  auto const& span = track(index);
+  auto const end = min<uint64_t>(span.end, instances_);
+  Track result;
+  result.reserve(end > span.begin ? end - span.begin : 0);
+  for (auto i = span.begin; i < end; ++i)
+  {
+    result.insert(instance(i));
+  }
+  return result;
+}
+
+size_t BinaryAnnotationFile::instances() const
+{
+  return instances_;
+}
+
+ros::Time BinaryAnnotationFile::stamp(size_t index) const
+{
+  ros::Time result;
+  result.fromNSec(column<uint64_t>(internal::Stamps)[index]);
+  return result;
+}
+
+uint64_t BinaryAnnotationFile::trackId(size_t index) const
+{
+  return column<uint64_t>(internal::TrackIds)[index];
+}
+
+TrackInstance BinaryAnnotationFile::instance(size_t index) const
+{
+  using namespace internal;
+  TrackInstance result;
+  result.label = text(InstanceLabels, column<uint32_t>(LabelIds)[index]);
+  result.center.frame_id_ = text(Frames, column<uint32_t>(FrameIds)[index]);
+  result.center.stamp_ = stamp(index);
+  auto const* t = column<double>(Translations) + 3 * index;
+  result.center.setOrigin({ t[0], t[1], t[2] });
+  auto const* r = column<double>(Rotations) + 4 * index;
+  result.center.setRotation({ r[0], r[1], r[2], r[3] });
+  auto const* b = column<double>(BoxSizes) + 3 * index;
+  result.box_size.setValue(b[0], b[1], b[2]);
+  return result;
+}
+
+void BinaryAnnotationFile::query(const ros::Time& begin, const ros::Time& end, vector<uint64_t>& instances) const
+{
+  instances.clear();
+  auto const* index = column<uint64_t>(internal::TimeIndex);
+  auto const* stamps = column<uint64_t>(internal::Stamps);
+  auto const count = instances_;
+  auto const first = lower_bound(index, index + count, begin.toNSec(), [stamps, count](uint64_t i, uint64_t value) {
+    return i < count && stamps[i] < value;
+  });
+  for (auto iter = first; iter != index + count && *iter < count && stamps[*iter] <= end.toNSec(); ++iter)
+  {
+    instances.push_back(*iter);
+  }
+}
+
+bool readBinary(const string& file, AnnotationData& data, string& error)
+{
+  BinaryAnnotationFile binary;
+  if (!binary.open(file, error))
+  {
+    return false;
+  }
+
+  data.labels = binary.labels();
+  data.tracks.reserve(data.tracks.size() + binary.tracks());
+  for (size_t i = 0; i < binary.tracks(); ++i)
+  {
+    AnnotationTrack track;
+    track.id = binary.track(i).id;
+    track.track = binary.trackInstances(i);
+    data.tracks.push_back(track);
+  }
+  return true;
+}
+
+bool writeBinary(const string& file, const AnnotationData& data, string& error)
+{
+  using namespace internal;
+  auto const instances = data.annotations();
+  vector<BinaryAnnotationFile::TrackSpan> spans;
+  spans.reserve(data.tracks.size());
+  vector<uint64_t> track_ids, stamps;
+  vector<double> translations, rotations, box_sizes;
+  vector<uint32_t> label_ids, frame_ids;
+  track_ids.reserve(instances);
+  stamps.reserve(instances);
+  translations.reserve(3 * instances);
+  rotations.reserve(4 * instances);
+  box_sizes.reserve(3 * instances);
+  label_ids.reserve(instances);
+  frame_ids.reserve(instances);
+
+  map<string, uint32_t> label_lookup, frame_lookup;
+  vector<string> labels, frames;
+  for (auto const& track : data.tracks)
+  {
+    BinaryAnnotationFile::TrackSpan span;
+    span.id = track.id;
+    span.begin = track_ids.size();
+    for (auto const& instance : track.track)
+    {
+      track_ids.push_back(track.id);
+      stamps.push_back(instance.center.stamp_.toNSec());
+      auto const t = instance.center.getOrigin();
+      translations.insert(translations.end(), { t.x(), t.y(), t.z() });
+      auto const r = instance.center.getRotation();
+      rotations.insert(rotations.end(), { r.x(), r.y(), r.z(), r.w() });
+      box_sizes.insert(box_sizes.end(), { instance.box_size.x(), instance.box_size.y(), instance.box_size.z() });
+      label_ids.push_back(textId(instance.label, label_lookup, labels));
+      frame_ids.push_back(textId(instance.center.frame_id_, frame_lookup, frames));
+    }
+    span.end = track_ids.size();
+    spans.push_back(span);
+  }
+
+  vector<uint64_t> time_index(instances);
+  iota(time_index.begin(), time_index.end(), 0);
+  stable_sort(time_index.begin(), time_index.end(),
+              [&stamps](uint64_t a, uint64_t b) { return stamps[a] < stamps[b]; });
+
+  auto const file_labels = encodeTexts(data.labels);
+  auto const instance_labels = encodeTexts(labels);
+  auto const frame_names = encodeTexts(frames);
+  pair<const char*, size_t> const sections[SectionCount] = {
+    { reinterpret_cast<const char*>(spans.data()), spans.size() * sizeof(spans.front()) },
+    { reinterpret_cast<const char*>(track_ids.data()), track_ids.size() * sizeof(uint64_t) },
+    { reinterpret_cast<const char*>(stamps.data()), stamps.size() * sizeof(uint64_t) },
+    { reinterpret_cast<const char*>(translations.data()), translations.size() * sizeof(double) },
+    { reinterpret_cast<const char*>(rotations.data()), rotations.size() * sizeof(double) },
+    { reinterpret_cast<const char*>(box_sizes.data()), box_sizes.size() * sizeof(double) },
+    { reinterpret_cast<const char*>(label_ids.data()), label_ids.size() * sizeof(uint32_t) },
+    { reinterpret_cast<const char*>(frame_ids.data()), frame_ids.size() * sizeof(uint32_t) },
+    { reinterpret_cast<const char*>(time_index.data()), time_index.size() * sizeof(uint64_t) },
+    { file_labels.data(), file_labels.size() },
+    { instance_labels.data(), instance_labels.size() },
+    { frame_names.data(), frame_names.size() }
+  };
+
+  BinaryHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, binary_magic, sizeof(binary_magic));
+  header.version = binary_version;
+  header.sections = SectionCount;
+  header.instances = instances;
+  header.tracks = spans.size();
+  uint64_t offset = sizeof(header);
+  for (size_t i = 0; i < SectionCount; ++i)
+  {
+    offset = (offset + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+    header.offset[i] = offset;
+    header.size[i] = sections[i].second;
+    offset += sections[i].second;
+  }
+
+  auto const temporary_file = file + ".tmp";
+  ofstream stream(temporary_file, ios::binary);
+  if (!stream.is_open())
+  {
+    stringstream status_stream;
+    status_stream << "Failed to open " << file << " for writing. Annotations will not be saved.";
+    error = status_stream.str();
+    return false;
+  }
+
+  char const padding[sizeof(uint64_t)] = {};
+  stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  uint64_t position = sizeof(header);
+  for (size_t i = 0; i < SectionCount; ++i)
+  {
+    stream.write(padding, header.offset[i] - position);
+    stream.write(sections[i].first, sections[i].second);
+    position = header.offset[i] + sections[i].second;
+  }
+  stream.close();
+  if (stream.fail() || !replaceFile(temporary_file, file))
+  {
+    remove(temporary_file.c_str());
+    stringstream status_stream;
+    status_stream << "Failed to write annotations to " << file;
+    error = status_stream.str();
+    return false;
+  }
+  return true;
+}
+
+}  // namespace annotate
@@ -0,0 +1,377 @@
+#include <annotate/annotation_file.h>
+#include <annotate/annotation_binary.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace annotate
+{
+size_t AnnotationData::annotations() const
+{
+  size_t result = 0;
+  for (auto const& track : tracks)
+  {
+    result += track.track.size();
+  }
+  return result;
+}
+
+void AnnotationData::insert(size_t id, const TrackInstance& instance)
+{
+  auto iter = find_if(tracks.begin(), tracks.end(), [id](AnnotationTrack const& track) { return track.id == id; });
+  if (iter == tracks.end())
+  {
+    tracks.push_back(AnnotationTrack());
+    tracks.back().id = id;
+    iter = tracks.end() - 1;
+  }
+  iter->track.insert(instance);
+}
+
+YAML::Node toYaml(const TrackInstance& instance)
+{
+  using namespace YAML;
+  Node i;
+  i["label"] = instance.label;
+
+  Node header;
+  header["frame_id"] = instance.center.frame_id_;
+  Node stamp;
+  stamp["secs"] = instance.center.stamp_.sec;
+  stamp["nsecs"] = instance.center.stamp_.nsec;
+  header["stamp"] = stamp;
+  i["header"] = header;
+
+  Node origin;
+  auto const o = instance.center.getOrigin();
+  origin["x"] = o.x();
+  origin["y"] = o.y();
+  origin["z"] = o.z();
+  i["translation"] = origin;
+
+  Node rotation;
+  auto const q = instance.center.getRotation();
+  rotation["x"] = q.x();
+  rotation["y"] = q.y();
+  rotation["z"] = q.z();
+  rotation["w"] = q.w();
+  i["rotation"] = rotation;
+
+  Node box;
+  box["length"] = instance.box_size.x();
+  box["width"] = instance.box_size.y();
+  box["height"] = instance.box_size.z();
+  i["box"] = box;
+  return i;
+}
+
+TrackInstance trackInstanceFromYaml(const YAML::Node& inst)
+{
+  using namespace YAML;
+  TrackInstance instance;
+  instance.label = inst["label"].as<string>();
+
+  Node header = inst["header"];
+  instance.center.frame_id_ = header["frame_id"].as<string>();
+  instance.center.stamp_.sec = header["stamp"]["secs"].as<uint32_t>();
+  instance.center.stamp_.nsec = header["stamp"]["nsecs"].as<uint32_t>();
+
+  Node origin = inst["translation"];
+  instance.center.setOrigin({ origin["x"].as<double>(), origin["y"].as<double>(), origin["z"].as<double>() });
+  Node rotation = inst["rotation"];
+  instance.center.setRotation({ rotation["x"].as<double>(), rotation["y"].as<double>(), rotation["z"].as<double>(),
+                                rotation["w"].as<double>() });
+
+  Node box = inst["box"];
+  instance.box_size.setX(box["length"].as<double>());
+  instance.box_size.setY(box["width"].as<double>());
+  instance.box_size.setZ(box["height"].as<double>());
+  return instance;
+}
+
+namespace internal
+{
+/** Approximate size of the text chunks parsed concurrently */
+size_t const yaml_chunk_size = 1 << 18;
+
+void parseLabels(const YAML::Node& labels, vector<string>& result)
+{
+  for (size_t i = 0; i < labels.size(); ++i)
+  {
+    result.push_back(labels[i].as<string>());
+  }
+}
+
+void parseTracks(const YAML::Node& tracks, vector<AnnotationTrack>& result)
+{
+  for (size_t i = 0; i < tracks.size(); ++i)
+  {
+    AnnotationTrack track;
+    YAML::Node annotation = tracks[i];
+    track.id = annotation["id"].as<size_t>();
+    YAML::Node t = annotation["track"];
+    for (size_t j = 0; j < t.size(); ++j)
+    {
+      track.track.insert(trackInstanceFromYaml(t[j]));
+    }
+    result.push_back(track);
+  }
+}
+
+string failure(const string& file, const string& message)
+{
+  stringstream stream;
+  stream << "Failed to open " << file << ": " << message;
+  return stream.str();
+}
+
+}  // namespace internal
+
+bool readYaml(const string& file, AnnotationData& data, string& error)
+{
+  try
+  {
+    YAML::Node node = YAML::LoadFile(file);
+    internal::parseLabels(node["labels"], data.labels);
+    internal::parseTracks(node["tracks"], data.tracks);
+  }
+  catch (YAML::Exception const& e)
+  {
+    error = internal::failure(file, e.msg);
+    return false;
+  }
+  return true;
+}
+
+bool readYaml(const string& file, AnnotationData& data, string& error, WorkerPool& pool,
+              const function<void(double)>& progress)
+{
+  ifstream stream(file, ios::binary | ios::ate);
+  if (!stream.is_open())
+  {
+    return readYaml(file, data, error);
+  }
+  size_t const total = max<streamoff>(1, stream.tellg());
+  stream.seekg(0);
+
+  atomic<size_t> parsed(0);
+  atomic<int> reported(-1);
+  auto const report = [&](size_t bytes) {
+    int const percent = int(100 * (parsed += bytes) / total);
+    int previous = reported;
+    while (percent > previous)
+    {
+      if (reported.compare_exchange_weak(previous, percent))
+      {
+        progress(percent / 100.0);
+        break;
+      }
+    }
+  };
+
+  // Items of the top-level tracks sequence are collected into chunks that are parsed as soon as they are complete.
+  // Everything else is parsed at the end.
+  vector<future<vector<AnnotationTrack>>> chunks;
+  string chunk;
+  size_t chunk_bytes = 0;
+  auto const submit = [&]() {
+    if (chunk.empty())
+    {
+      return;
+    }
+    auto const text = make_shared<string>("tracks:\n" + chunk);
+    auto const bytes = chunk_bytes;
+    chunks.push_back(pool.submit([text, bytes, &report]() {
+      vector<AnnotationTrack> tracks;
+      internal::parseTracks(YAML::Load(*text)["tracks"], tracks);
+      report(bytes);
+      return tracks;
+    }));
+    chunk.clear();
+    chunk_bytes = 0;
+  };
+
+  string rest;
+  string line;
+  bool in_tracks = false;
+  bool sequential = false;
+  size_t item_indent = string::npos;
+  while (!sequential && getline(stream, line))
+  {
+    if (line.compare(0, 3, "---") == 0 || line.compare(0, 3, "...") == 0 || line.compare(0, 1, "%") == 0)
+    {
+      // Multiple documents or directives
+      sequential = true;
+    }
+    else if (!line.empty() && !isspace(line[0]) && line[0] != '-' && line[0] != '#')
+    {
+      submit();
+      auto const end = line.find_last_not_of(" \t\r");
+      in_tracks = line.compare(0, end + 1, "tracks:") == 0;
+      item_indent = string::npos;
+      if (!in_tracks)
+      {
+        rest += line + "\n";
+      }
+    }
+    else if (in_tracks)
+    {
+      auto const indent = line.find_first_not_of(' ');
+      bool const item = indent != string::npos && line[indent] == '-' &&
+                        (indent + 1 == line.size() || isspace(line[indent + 1]));
+      if (item && (item_indent == string::npos || indent == item_indent))
+      {
+        item_indent = indent;
+        if (chunk_bytes >= internal::yaml_chunk_size)
+        {
+          submit();
+        }
+      }
+      chunk += line + "\n";
+      chunk_bytes += line.size() + 1;
+    }
+    else
+    {
+      rest += line + "\n";
+    }
+  }
+  if (!sequential)
+  {
+    submit();
+  }
+
+  // All chunks must be finished before returning, they refer to local state
+  auto const first_track = data.tracks.size();
+  bool failed = false;
+  for (auto& result : chunks)
+  {
+    try
+    {
+      auto const tracks = result.get();
+      data.tracks.insert(data.tracks.end(), tracks.begin(), tracks.end());
+    }
+    catch (exception const&)
+    {
+      failed = true;
+    }
+  }
+
+  if (sequential || failed)
+  {
+    // The sequential reader reports errors with correct line numbers
+    data.tracks.resize(first_track);
+    return readYaml(file, data, error);
+  }
+
+  try
+  {
+    YAML::Node node = YAML::Load(rest);
+    internal::parseLabels(node["labels"], data.labels);
+    internal::parseTracks(node["tracks"], data.tracks);
+  }
+  catch (YAML::Exception const& e)
+  {
+    error = internal::failure(file, e.msg);
+    return false;
+  }
+  report(rest.size());
+  progress(1.0);
+  return true;
+}
+
+bool writeYaml(const string& file, const AnnotationData& data, string& error)
+{
+  using namespace YAML;
+  Node node;
+  for (auto const& label : data.labels)
+  {
+    node["labels"].push_back(label);
+  }
+  for (auto const& track : data.tracks)
+  {
+    Node annotation;
+    annotation["id"] = track.id;
+    for (auto const& instance : track.track)
+    {
+      annotation["track"].push_back(toYaml(instance));
+    }
+    node["tracks"].push_back(annotation);
+  }
+
+  auto const temporary_file = file + ".tmp";
+  ofstream stream(temporary_file);
+  if (!stream.is_open())
+  {
+    stringstream status_stream;
+    status_stream << "Failed to open " << file << " for writing. Annotations will not be saved.";
+    error = status_stream.str();
+    return false;
+  }
+
+  stream << node;
+  stream.close();
+  if (stream.fail() || !replaceFile(temporary_file, file))
+  {
+    remove(temporary_file.c_str());
+    stringstream status_stream;
+    status_stream << "Failed to write annotations to " << file;
+    error = status_stream.str();
+    return false;
+  }
+  return true;
+}
+
+bool replaceFile(const string& temporary_file, const string& file)
+{
+  auto const sync = [](const string& path) {
+    int const descriptor = ::open(path.c_str(), O_RDONLY);
+    if (descriptor < 0)
+    {
+      return false;
+    }
+    bool const synced = ::fsync(descriptor) == 0;
+    ::close(descriptor);
+    return synced;
+  };
+
+  if (!sync(temporary_file) || rename(temporary_file.c_str(), file.c_str()) != 0)
+  {
+    remove(temporary_file.c_str());
+    return false;
+  }
+  auto const separator = file.find_last_of('/');
+  auto const directory = separator == string::npos ? string(".") : file.substr(0, max<size_t>(1, separator));
+  return sync(directory);
+}
+
+bool isBinaryAnnotationFile(const string& file)
+{
+  string const extension = ".annotate";
+  return file.size() >= extension.size() && file.compare(file.size() - extension.size(), string::npos, extension) == 0;
+}
+
+bool readAnnotations(const string& file, AnnotationData& data, string& error)
+{
+  return isBinaryAnnotationFile(file) ? readBinary(file, data, error) : readYaml(file, data, error);
+}
+
+bool readAnnotations(const string& file, AnnotationData& data, string& error, WorkerPool& pool,
+                     const function<void(double)>& progress)
+{
+  return isBinaryAnnotationFile(file) ? readBinary(file, data, error) : readYaml(file, data, error, pool, progress);
+}
+
+bool writeAnnotations(const string& file, const AnnotationData& data, string& error)
+{
+  return isBinaryAnnotationFile(file) ? writeBinary(file, data, error) : writeYaml(file, data, error);
+}
+
+}  // namespace annotate
@@ -0,0 +1,257 @@
+#include <annotate/annotation_journal.h>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace annotate
+{
+AnnotationJournal::~AnnotationJournal()
+{
+  close();
+}
+
+bool AnnotationJournal::open(const string& annotation_file, bool truncate)
+{
+  close();
+  annotation_file_ = annotation_file;
+  if (truncate)
+  {
+    removeRotated();
+  }
+  records_ = 0;
+  bool terminated = true;
+  if (!truncate)
+  {
+    ifstream existing(journalFile(annotation_file));
+    string line;
+    while (getline(existing, line))
+    {
+      ++records_;
+      terminated = !existing.eof();
+    }
+  }
+  int const flags = O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0);
+  descriptor_ = ::open(journalFile(annotation_file).c_str(), flags, 0644);
+  if (descriptor_ >= 0 && !terminated)
+  {
+    // Keep the next record apart from an incomplete one left behind by a crash
+    if (::write(descriptor_, "\n", 1) != 1)
+    {
+      close();
+    }
+  }
+  last_sync_ = chrono::steady_clock::now();
+  unsynced_ = false;
+  return descriptor_ >= 0;
+}
+
+void AnnotationJournal::close()
+{
+  if (descriptor_ >= 0)
+  {
+    ::fsync(descriptor_);
+    ::close(descriptor_);
+    descriptor_ = -1;
+  }
+}
+
+bool AnnotationJournal::isOpen() const
+{
+  return descriptor_ >= 0;
+}
+
+void AnnotationJournal::setSyncPolicy(SyncPolicy policy)
+{
+  sync_policy_ = policy;
+}
+
+bool AnnotationJournal::append(size_t id, const TrackInstance& instance)
+{
+  YAML::Node record;
+  record["id"] = id;
+  for (auto const& field : toYaml(instance))
+  {
+    record[field.first.as<string>()] = field.second;
+  }
+  return write(record);
+}
+
+bool AnnotationJournal::appendLabels(const vector<string>& labels)
+{
+  YAML::Node record;
+  record["labels"] = labels;
+  return write(record);
+}
+
+void AnnotationJournal::sync()
+{
+  if (descriptor_ >= 0)
+  {
+    ::fdatasync(descriptor_);
+    last_sync_ = chrono::steady_clock::now();
+    unsynced_ = false;
+  }
+}
+
+bool AnnotationJournal::unsynced() const
+{
+  return unsynced_;
+}
+
+size_t AnnotationJournal::records() const
+{
+  return records_;
+}
+
+bool AnnotationJournal::write(const YAML::Node& record)
+{
+  if (descriptor_ < 0)
+  {
+    return false;
+  }
+
+  YAML::Emitter emitter;
+  emitter.SetMapFormat(YAML::Flow);
+  emitter.SetSeqFormat(YAML::Flow);
+  emitter << record;
+  string const line = string(emitter.c_str()) + "\n";
+  struct stat status;
+  if (::fstat(descriptor_, &status) != 0)
+  {
+    return false;
+  }
+  size_t written = 0;
+  while (written < line.size())
+  {
+    auto const result = ::write(descriptor_, line.data() + written, line.size() - written);
+    if (result < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (result < 0)
+    {
+      // Remove a partially written record, it would swallow the next one. If that fails as well, stop appending
+      // to the journal altogether.
+      if (written > 0 && ::ftruncate(descriptor_, status.st_size) != 0)
+      {
+        close();
+      }
+      return false;
+    }
+    written += size_t(result);
+  }
+  ++records_;
+  unsynced_ = true;
+
+  switch (sync_policy_)
+  {
+    case SyncEveryRecord:
+      sync();
+      break;
+    case SyncPeriodically:
+      if (chrono::steady_clock::now() - last_sync_ > chrono::seconds(1))
+      {
+        sync();
+      }
+      break;
+    case SyncNever:
+      break;
+  }
+  return true;
+}
+
+bool AnnotationJournal::rotate()
+{
+  if (descriptor_ < 0)
+  {
+    return false;
+  }
+  close();
+
+  auto const journal = journalFile(annotation_file_);
+  auto const rotated = rotatedFile(annotation_file_);
+  ifstream existing(rotated);
+  if (existing.good())
+  {
+    // A previous compaction failed. Keep its records and append the current ones.
+    existing.close();
+    ofstream output(rotated, ios::app);
+    ifstream input(journal);
+    output << input.rdbuf();
+    output.close();
+    if (output.fail())
+    {
+      open(annotation_file_, false);
+      return false;
+    }
+  }
+  else if (::rename(journal.c_str(), rotated.c_str()) != 0)
+  {
+    open(annotation_file_, false);
+    return false;
+  }
+
+  descriptor_ = ::open(journal.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0644);
+  records_ = 0;
+  unsynced_ = false;
+  return descriptor_ >= 0;
+}
+
+void AnnotationJournal::removeRotated()
+{
+  if (!annotation_file_.empty())
+  {
+    ::remove(rotatedFile(annotation_file_).c_str());
+  }
+}
+
+size_t AnnotationJournal::replay(const string& annotation_file, AnnotationData& data)
+{
+  return replayFile(rotatedFile(annotation_file), data) + replayFile(journalFile(annotation_file), data);
+}
+
+size_t AnnotationJournal::replayFile(const string& file, AnnotationData& data)
+{
+  size_t records = 0;
+  ifstream stream(file);
+  string line;
+  while (getline(stream, line))
+  {
+    try
+    {
+      auto const record = YAML::Load(line);
+      if (record["labels"])
+      {
+        data.labels = record["labels"].as<vector<string>>();
+        ++records;
+      }
+      else if (record["id"])
+      {
+        data.insert(record["id"].as<size_t>(), trackInstanceFromYaml(record));
+        ++records;
+      }
+    }
+    catch (YAML::Exception const&)
+    {
+      // Incomplete record, most likely written during a crash
+    }
+  }
+  return records;
+}
+
+string AnnotationJournal::journalFile(const string& annotation_file)
+{
+  return annotation_file + ".journal";
+}
+
+string AnnotationJournal::rotatedFile(const string& annotation_file)
+{
+  return annotation_file + ".journal.old";
+}
+
+}  // namespace annotate
@@ -2,11 +2,6 @@
 #include <annotate/annotate_display.h>
 #include <sstream>
 #include <visualization_msgs/MarkerArray.h>
-#include <pcl_conversions/pcl_conversions.h>
-#include <pcl/point_cloud.h>
-#include <pcl/point_types.h>
-#include <pcl_ros/point_cloud.h>
-#include <pcl_ros/transforms.h>
 #include <QColor>
 #include <random>
 
@@ -48,11 +43,6 @@ void setRotation(geometry_msgs::Quaternion& quaternion, double x, double y, doub
   quaternionTFToMsg(orientation, quaternion);
 }
 
-double TrackInstance::timeTo(ros::Time const& time) const
-{
-  return fabs((time - center.stamp_).toSec());
-}
-
 void AnnotationMarker::removeControls()
 {
   marker_.controls.resize(1);
@@ -135,6 +125,11 @@ AnnotationMarker::AnnotationMarker(AnnotateDisplay* annotate_display, const shar
   createMarker(trackInstance);
 }
 
+AnnotationMarker::~AnnotationMarker()
+{
+  server_->erase(marker_.name);
+}
+
 void AnnotationMarker::setLabels(const std::vector<std::string>& labels)
 {
   label_keys_ = labels;
@@ -192,6 +187,7 @@ void AnnotationMarker::updateMenu(const PointContext& context)
 
 void AnnotationMarker::processFeedback(const InteractiveMarkerFeedbackConstPtr& feedback)
 {
+  TraceRecorder::Scope scope(annotate_display_->traceRecorder(), "processFeedback", id_);
   switch (feedback->event_type)
   {
     case InteractiveMarkerFeedback::POSE_UPDATE:
@@ -287,11 +283,16 @@ void AnnotationMarker::pull()
 
 void AnnotationMarker::push()
 {
-  auto const context = analyzePoints();
+  LatencyMonitor::Timer timer(annotate_display_->latencyMonitor(), LatencyMonitor::Push);
+  publish(analyzePoints());
+  annotate_display_->scheduleServerUpdate();
+}
+
+void AnnotationMarker::publish(const PointContext& context)
+{
   updateDescription(context);
   server_->insert(marker_, boost::bind(&AnnotationMarker::processFeedback, this, _1));
   updateMenu(context);
-  server_->applyChanges();
 }
 
 void AnnotationMarker::nextMode()
@@ -424,76 +425,170 @@ void AnnotationMarker::setLabel(const visualization_msgs::InteractiveMarkerFeedb
 
 void AnnotationMarker::shrinkTo(const PointContext& context)
 {
-  if (!context.points_inside)
+  auto box = snapshot(cloud_transform_);
+  if (!has_cloud_transform_)
   {
-    return;
+    box.ground.reset();
   }
-
-  Stamped<Point> input(0.5 * (context.maximum + context.minimum), context.time, "current_annotation");
-  Stamped<Point> output;
-  annotate_display_->transformListener().transformPoint(marker_.header.frame_id, input, output);
-  pointTFToMsg(output, marker_.pose.position);
-  double const offset = 0.05;
-  Vector3 const margin(offset, offset, offset);
-  setBoxSize(margin + context.maximum - context.minimum);
+  annotate::shrinkTo(box, context);
+  apply(box);
 }
 
 void AnnotationMarker::shrink(const visualization_msgs::InteractiveMarkerFeedbackConstPtr& feedback)
 {
   pull();
-  auto const context = analyzePoints();
-  if (context.points_inside)
+  fitInBackground(Shrink);
+}
+
+bool AnnotationMarker::fitNearbyPoints(const Transform& cloud_transform)
+{
+  LatencyMonitor::Timer timer(annotate_display_->latencyMonitor(), LatencyMonitor::FitNearbyPoints);
+  auto box = snapshot(cloud_transform);
+  string error;
+  bool const fitted = auto_fit_orientation_ ? annotate::fitOrientation(box, referenceYaw(), error) :
+                                              annotate::fitNearbyPoints(box, error);
+  if (!fitted)
   {
-    saveForUndo("shrink to points");
-    shrinkTo(context);
-    updateState(Modified);
-    push();
+    return false;
   }
+  apply(box);
+  return true;
 }
 
-bool AnnotationMarker::fitNearbyPoints()
+void AnnotationMarker::autoFit()
 {
+  pull();
+  fitInBackground(AutoFit);
+}
+
+void AnnotationMarker::autoFit(const visualization_msgs::InteractiveMarkerFeedbackConstPtr& feedback)
+{
+  autoFit();
+}
+
+bool AnnotationMarker::fitInBackground(FitOperation operation)
+{
+  // Supersedes fits requested earlier. They stop early and their results are dropped.
+  auto const generation = ++*fit_generation_;
+  if (!has_cloud_transform_)
   {
-    auto const context = analyzePoints();
-    if (context.points_nearby == 0)
-    {
-      shrinkTo(context);
-      return true;
-    }
+    has_cloud_transform_ = lookupCloudTransform(cloud_transform_);
+  }
+  if (!has_cloud_transform_)
+  {
+    return false;
   }
 
-  for (int i = 0; i < 4; ++i)
+  FitResult request;
+  request.marker_id = id_;
+  request.token = fit_generation_;
+  request.generation = generation;
+  request.operation = operation;
+  request.box = snapshot(cloud_transform_);
+  if (operation == AutoFit && annotate_display_->autoFitOrientation())
   {
-    resize(0.25);
-    auto const context = analyzePoints();
-    if (context.points_nearby == 0)
+    request.fit_orientation = true;
+    request.reference_yaw = referenceYaw();
+  }
+  // The monitor belongs to the display, which waits for the worker pool before it goes away
+  auto* monitor = &annotate_display_->latencyMonitor();
+  annotate_display_->fitInBackground([request, monitor]() {
+    auto result = request;
+    auto const cancelled = [&result]() { return *result.token != result.generation; };
+    if (result.operation == AutoFit)
     {
-      shrinkTo(context);
-      return true;
+      LatencyMonitor::Timer timer(*monitor, LatencyMonitor::FitNearbyPoints);
+      if (result.fit_orientation)
+      {
+        result.success = annotate::fitOrientation(result.box, result.reference_yaw, result.error, cancelled);
+      }
+      else
+      {
+        result.success = annotate::fitNearbyPoints(result.box, result.error, cancelled);
+      }
     }
-  }
-
-  return false;
+    else if (!cancelled())
+    {
+      LatencyMonitor::Timer timer(*monitor, LatencyMonitor::AnalyzePoints);
+      auto const context = annotate::analyzePoints(result.box);
+      result.success = context.points_inside > 0;
+      annotate::shrinkTo(result.box, context);
+    }
+    return result;
+  });
+  return true;
 }
 
-void AnnotationMarker::autoFit()
+void AnnotationMarker::applyFit(const FitResult& result)
 {
+  if (result.token != fit_generation_ || result.generation != *fit_generation_)
+  {
+    return;
+  }
+
   pull();
-  saveForUndo("auto-fit box");
-  if (fitNearbyPoints())
+  if (result.success)
   {
+    saveForUndo(result.operation == AutoFit ? "auto-fit box" : "shrink to points");
+    apply(result.box);
     updateState(Modified);
+  }
+  else if (result.operation == AutoFit)
+  {
+    ROS_WARN_STREAM("Auto-fit of annotation #" << id_ << " failed: " << result.error);
+  }
+
+  if (commit_pending_)
+  {
+    commit_pending_ = false;
+    finishCommit();
+  }
+  else if (result.success)
+  {
     push();
   }
-  else if (!undo_stack_.empty() && undo_stack_.top().undo_description == "auto-fit box")
+}
+
+double AnnotationMarker::referenceYaw() const
+{
+  // Estimated orientations point in the direction of the latest annotation of the track up to now, if any
+  Quaternion rotation;
+  auto const previous = track_.range(ros::Time(), time_);
+  if (previous.first != previous.second)
+  {
+    rotation = prev(previous.second)->center.getRotation();
+  }
+  else if (!track_.empty())
+  {
+    rotation = track_.front().center.getRotation();
+  }
+  else
   {
-    undo();
+    quaternionMsgToTF(marker_.pose.orientation, rotation);
   }
+  return getYaw(rotation);
 }
 
-void AnnotationMarker::autoFit(const visualization_msgs::InteractiveMarkerFeedbackConstPtr& feedback)
+BoxSnapshot AnnotationMarker::snapshot(const Transform& cloud_transform) const
 {
-  autoFit();
+  BoxSnapshot box;
+  poseMsgToTF(marker_.pose, box.pose);
+  box.size = boxSize();
+  box.cloud_transform = cloud_transform;
+  box.ignore_ground = ignore_ground_;
+  box.cloud = annotate_display_->cloudCache();
+  box.index = annotate_display_->spatialIndex();
+  if (ignore_ground_)
+  {
+    box.ground = annotate_display_->groundModel();
+  }
+  return box;
+}
+
+void AnnotationMarker::apply(const BoxSnapshot& box)
+{
+  poseTFToMsg(box.pose, marker_.pose);
+  setBoxSize(box.size);
 }
 
 void AnnotationMarker::saveMove()
@@ -568,99 +663,35 @@ void AnnotationMarker::undo(const visualization_msgs::InteractiveMarkerFeedbackC
   undo();
 }
 
-void AnnotationMarker::resize(double offset)
+bool AnnotationMarker::lookupCloudTransform(StampedTransform& transform) const
 {
-  if (!marker_.controls.empty() && !marker_.controls.front().markers.empty())
-  {
-    auto& box = marker_.controls.front().markers.front();
-    if (ignore_ground_)
-    {
-      marker_.pose.position.z += offset / 4.0;
-      setBoxSize({ box.scale.x + offset, box.scale.y + offset, box.scale.z + offset / 2.0 });
-    }
-    else
-    {
-      setBoxSize({ box.scale.x + offset, box.scale.y + offset, box.scale.z + offset });
-    }
-  }
+  return annotate_display_->cloudTransform(id_, marker_.header.frame_id, time_, transform);
 }
 
-AnnotationMarker::PointContext AnnotationMarker::analyzePoints() const
+PointContext AnnotationMarker::analyzePoints() const
 {
-  Transform transform;
-  poseMsgToTF(marker_.pose, transform);
-  auto const cloud = annotate_display_->cloud();
-  PointContext context;
-  if (!cloud)
+  // The transform from the cloud is looked up once per frame in beginTime()
+  if (has_cloud_transform_)
   {
-    return context;
+    return analyzePoints(cloud_transform_);
   }
-  context.time = min(time_, cloud->header.stamp);
-  auto const stamped_transform =
-      StampedTransform(transform, context.time, marker_.header.frame_id, "current_annotation");
 
-  auto& transform_listener = annotate_display_->transformListener();
-  transform_listener.setTransform(stamped_transform);
-  string error;
-  bool const can_transform = transform_listener.waitForTransform("current_annotation", cloud->header.frame_id,
-                                                                 context.time, ros::Duration(0.25));
-  auto const time = can_transform ? context.time : ros::Time();
-  if (transform_listener.canTransform("current_annotation", cloud->header.frame_id, time, &error))
-  {
-    StampedTransform trafo;
-    transform_listener.lookupTransform("current_annotation", cloud->header.frame_id, time, trafo);
-    pcl::PointCloud<pcl::PointXYZ> pointcloud;
-    pcl::fromROSMsg(*cloud, pointcloud);
-    if (pointcloud.points.empty())
-    {
-      return context;
-    }
-    pcl::PointCloud<pcl::PointXYZ> annotation_cloud;
-    pcl_ros::transformPointCloud(pointcloud, annotation_cloud, trafo);
-    Vector3 points_min(numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max());
-    Vector3 points_max(numeric_limits<float>::min(), numeric_limits<float>::min(), numeric_limits<float>::min());
-    if (!marker_.controls.empty() && !marker_.controls.front().markers.empty())
-    {
-      auto& box = marker_.controls.front().markers.front();
-      Vector3 box_min;
-      vector3MsgToTF(box.scale, box_min);
-      box_min = -0.5 * box_min;
-      Vector3 const box_max = -box_min;
-      Vector3 offset(0.25, 0.25, 0.25);
-      Vector3 const nearby_max = box_max + offset;
-      Vector3 nearby_min = box_min - offset;
-      if (ignore_ground_)
-      {
-        nearby_min.setZ(box_min.z());
-      }
-      for (auto const& p : annotation_cloud.points)
-      {
-        Vector3 const point(p.x, p.y, p.z);
-        Vector3 alien = point;
-        alien.setMax(nearby_min);
-        alien.setMin(nearby_max);
-        if (alien == point)
-        {
-          Vector3 canary = point;
-          canary.setMax(box_min);
-          canary.setMin(box_max);
-          if (canary == point)
-          {
-            ++context.points_inside;
-            context.minimum.setMin(point);
-            context.maximum.setMax(point);
-          }
-          else
-          {
-            ++context.points_nearby;
-          }
-        }
-      }
-    }
+  StampedTransform cloud_transform;
+  if (!lookupCloudTransform(cloud_transform))
+  {
+    return PointContext();
   }
-  else
+  return analyzePoints(cloud_transform);
+}
+
+PointContext AnnotationMarker::analyzePoints(const Transform& cloud_transform) const
+{
+  LatencyMonitor::Timer timer(annotate_display_->latencyMonitor(), LatencyMonitor::AnalyzePoints);
+  auto context = annotate::analyzePoints(snapshot(cloud_transform));
+  auto const cloud = annotate_display_->cloudCache();
+  if (cloud)
   {
-    ROS_WARN_STREAM("Transformation failed: " << error);
+    context.time = min(time_, cloud->stamp());
   }
   return context;
 }
@@ -681,17 +712,17 @@ void AnnotationMarker::rotateYaw(double delta_rad)
 void AnnotationMarker::commit()
 {
   pull();
-  if (annotate_display_->shrinkBeforeCommit())
+  if (annotate_display_->shrinkBeforeCommit() && fitInBackground(Shrink))
   {
-    auto const context = analyzePoints();
-    if (context.points_inside)
-    {
-      saveForUndo("shrink to points");
-      shrinkTo(context);
-      updateState(Modified);
-    }
+    // Committed once the box is shrunk
+    commit_pending_ = true;
+    return;
   }
+  finishCommit();
+}
 
+void AnnotationMarker::finishCommit()
+{
   TrackInstance instance;
   instance.label = label_;
 
@@ -707,13 +738,8 @@ void AnnotationMarker::commit()
 
   tf_broadcaster_.sendTransform(instance.center);
 
-  track_.erase(
-      remove_if(track_.begin(), track_.end(), [this](const TrackInstance& t) { return t.center.stamp_ == time_; }),
-      track_.end());
-  track_.push_back(instance);
-  sort(track_.begin(), track_.end(),
-       [](TrackInstance const& a, TrackInstance const& b) -> bool { return a.center.stamp_ < b.center.stamp_; });
-  if (annotate_display_->save())
+  track_.insert(instance);
+  if (annotate_display_->saveInstance(id_, instance))
   {
     updateState(Committed);
   }
@@ -790,17 +816,46 @@ StampedTransform estimatePose(StampedTransform const& a, StampedTransform const&
 
 void AnnotationMarker::setTime(const ros::Time& time)
 {
+  if (beginTime(time))
+  {
+    updateTime();
+    finishTime();
+  }
+  annotate_display_->scheduleServerUpdate();
+}
+
+void AnnotationMarker::finishPendingCommit()
+{
+  if (commit_pending_)
+  {
+    commit_pending_ = false;
+    pull();
+    auto const context = analyzePoints();
+    if (context.points_inside)
+    {
+      shrinkTo(context);
+      updateState(Modified);
+    }
+    finishCommit();
+  }
+}
+
+bool AnnotationMarker::beginTime(const ros::Time& time)
+{
+  // Do not lose a commit waiting for a background shrink. Commit it for the old time right away.
+  finishPendingCommit();
+  // Background fits of the previous time no longer apply
+  ++*fit_generation_;
+
   time_ = time;
+  has_cloud_transform_ = false;
   if (!track_.empty())
   {
-    auto const prune_before_track_start = time < track_.front().center.stamp_ && track_.front().timeTo(time) > 1.0;
-    auto const prune_after_track_end = time > track_.back().center.stamp_ && track_.back().timeTo(time) > 1.0;
-    if (prune_before_track_start || prune_after_track_end)
+    if (!spans(track_, time, 1.0))
     {
       server_->erase(marker_.name);
-      server_->applyChanges();
       updateState(Hidden);
-      return;
+      return false;
     }
   }
 
@@ -810,38 +865,77 @@ void AnnotationMarker::setTime(const ros::Time& time)
     undo_stack_.pop();
   }
   marker_.header.stamp = time;
+  has_cloud_transform_ = lookupCloudTransform(cloud_transform_);
+  auto_fit_after_predict_ = annotate_display_->autoFitAfterPredict();
+  auto_fit_orientation_ = annotate_display_->autoFitOrientation();
+  return true;
+}
+
+void AnnotationMarker::updateTime()
+{
+  auto const time = time_;
+  time_context_ = PointContext();
 
   // Find an existing annotation for this point in time, if any
-  for (auto const& instance : track_)
+  auto const* instance = track_.find(time, 0.01);
+  if (instance)
   {
-    if (instance.timeTo(time) < 0.01)
+    label_ = instance->label;
+    updateState(Committed);
+    poseTFToMsg(instance->center, marker_.pose);
+    setBoxSize(instance->box_size);
+    if (has_cloud_transform_)
     {
-      label_ = instance.label;
-      updateState(Committed);
-      poseTFToMsg(instance.center, marker_.pose);
-      setBoxSize(instance.box_size);
-      push();
-      return;
+      time_context_ = analyzePoints(cloud_transform_);
     }
+    return;
   }
 
   // Estimate a suitable pose from nearby annotations
-  Track track = track_;
-  sort(track.begin(), track.end(),
-       [time](TrackInstance const& a, TrackInstance const& b) -> bool { return a.timeTo(time) < b.timeTo(time); });
+  const TrackInstance* first = nullptr;
+  const TrackInstance* second = nullptr;
   double const extrapolation_limit = 2.0;
-  if (track.size() > 1 && track[1].timeTo(time) < extrapolation_limit)
+  if (track_.nearest(time, first, second) && second->timeTo(time) < extrapolation_limit)
   {
-    auto const transform = estimatePose(track[0].center, track[1].center, time);
+    auto const transform = estimatePose(first->center, second->center, time);
     poseTFToMsg(transform, marker_.pose);
-    if (annotate_display_->autoFitAfterPredict())
+    if (auto_fit_after_predict_ && has_cloud_transform_)
     {
-      fitNearbyPoints();
+      fitNearbyPoints(cloud_transform_);
     }
   }
 
   updateState(New);
-  push();
+  if (has_cloud_transform_)
+  {
+    time_context_ = analyzePoints(cloud_transform_);
+  }
+}
+
+void AnnotationMarker::finishTime()
+{
+  publish(time_context_);
+}
+
+void AnnotationMarker::updateCloudTransform()
+{
+  if (state_ == Hidden || !lookupCloudTransform(cloud_transform_))
+  {
+    return;
+  }
+
+  has_cloud_transform_ = true;
+  pull();
+  if (undo_stack_.empty())
+  {
+    // Untouched since the time changed: redo the prediction and fitting that needed the transform
+    updateTime();
+    finishTime();
+  }
+  else
+  {
+    publish(analyzePoints(cloud_transform_));
+  }
 }
 
 void AnnotationMarker::setTrack(const Track& track)
@@ -0,0 +1,447 @@
+#include <annotate/bag_reader.h>
+#include <algorithm>
+#include <bzlib.h>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <roslz4/lz4s.h>
+#include <sstream>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace annotate
+{
+namespace internal
+{
+char const bag_magic[] = "#ROSBAG V2.0\n";
+size_t const bag_magic_size = sizeof(bag_magic) - 1;
+/// Limit of decompressed chunks, far above the default chunk size of rosbag (768 KiB)
+uint32_t const max_chunk_size = 1u << 30;
+
+enum BagOperation
+{
+  MessageData = 0x02,
+  BagHeader = 0x03,
+  IndexData = 0x04,
+  ChunkRecord = 0x05,
+  ChunkInfo = 0x06,
+  ConnectionRecord = 0x07
+};
+
+/// Position and size of header and data of a record, and where the next record starts
+struct BagRecord
+{
+  const uint8_t* header;
+  uint32_t header_size;
+  const uint8_t* data;
+  uint32_t data_size;
+  uint64_t end;
+};
+
+using BagFields = map<string, pair<const uint8_t*, uint32_t>>;
+
+template <class T>
+T readValue(const uint8_t* data)
+{
+  T value;
+  memcpy(&value, data, sizeof(T));
+  return value;
+}
+
+bool readRecord(const uint8_t* begin, uint64_t size, uint64_t position, BagRecord& record)
+{
+  if (position > size || size - position < sizeof(uint32_t))
+  {
+    return false;
+  }
+  record.header_size = readValue<uint32_t>(begin + position);
+  position += sizeof(uint32_t);
+  if (size - position < uint64_t(record.header_size) + sizeof(uint32_t))
+  {
+    return false;
+  }
+  record.header = begin + position;
+  position += record.header_size;
+  record.data_size = readValue<uint32_t>(begin + position);
+  position += sizeof(uint32_t);
+  if (size - position < record.data_size)
+  {
+    return false;
+  }
+  record.data = begin + position;
+  record.end = position + record.data_size;
+  return true;
+}
+
+/// Split a record header or connection header into its name=value fields
+bool readFields(const uint8_t* begin, uint32_t size, BagFields& fields)
+{
+  fields.clear();
+  uint32_t position = 0;
+  while (position < size)
+  {
+    if (size - position < sizeof(uint32_t))
+    {
+      return false;
+    }
+    auto const length = readValue<uint32_t>(begin + position);
+    position += sizeof(uint32_t);
+    if (length > size - position)
+    {
+      return false;
+    }
+    auto const* field = begin + position;
+    auto const* separator = static_cast<const uint8_t*>(memchr(field, '=', length));
+    if (!separator)
+    {
+      return false;
+    }
+    auto const name_size = uint32_t(separator - field);
+    fields[string(reinterpret_cast<const char*>(field), name_size)] = { separator + 1, length - name_size - 1 };
+    position += length;
+  }
+  return true;
+}
+
+template <class T>
+bool field(const BagFields& fields, const string& name, T& value)
+{
+  auto const iter = fields.find(name);
+  if (iter == fields.end() || iter->second.second != sizeof(T))
+  {
+    return false;
+  }
+  value = readValue<T>(iter->second.first);
+  return true;
+}
+
+bool field(const BagFields& fields, const string& name, string& value)
+{
+  auto const iter = fields.find(name);
+  if (iter == fields.end())
+  {
+    return false;
+  }
+  value.assign(reinterpret_cast<const char*>(iter->second.first), iter->second.second);
+  return true;
+}
+
+bool isOperation(const BagFields& fields, BagOperation operation)
+{
+  uint8_t value;
+  return field(fields, "op", value) && value == operation;
+}
+
+ros::Time readTime(const uint8_t* data)
+{
+  return ros::Time(readValue<uint32_t>(data), readValue<uint32_t>(data + sizeof(uint32_t)));
+}
+
+}  // namespace internal
+
+BagReader::~BagReader()
+{
+  close();
+}
+
+bool BagReader::open(const string& file, string& error)
+{
+  close();
+
+  auto const fail = [&](const string& message) {
+    close();
+    stringstream stream;
+    stream << "Failed to open " << file << ": " << message;
+    error = stream.str();
+    return false;
+  };
+
+  int const descriptor = ::open(file.c_str(), O_RDONLY);
+  if (descriptor < 0)
+  {
+    return fail(strerror(errno));
+  }
+  struct stat status;
+  if (fstat(descriptor, &status) != 0 || size_t(status.st_size) < internal::bag_magic_size)
+  {
+    ::close(descriptor);
+    return fail("Not a bag file");
+  }
+  size_ = size_t(status.st_size);
+  void* mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, descriptor, 0);
+  ::close(descriptor);
+  if (mapping == MAP_FAILED)
+  {
+    return fail(strerror(errno));
+  }
+  mapping_ = mapping;
+  if (memcmp(mapping_, internal::bag_magic, internal::bag_magic_size) != 0)
+  {
+    return fail("Not a bag file of version 2.0");
+  }
+
+  string message;
+  if (!readIndex(message))
+  {
+    return fail(message);
+  }
+  return true;
+}
+
+bool BagReader::readIndex(string& error)
+{
+  using namespace internal;
+  auto const* bag = static_cast<const uint8_t*>(mapping_);
+  BagRecord record;
+  BagFields fields;
+  uint64_t index_position = 0;
+  if (!readRecord(bag, size_, bag_magic_size, record) || !readFields(record.header, record.header_size, fields) ||
+      !isOperation(fields, BagHeader) || !field(fields, "index_pos", index_position))
+  {
+    error = "Truncated or corrupt bag header";
+    return false;
+  }
+  if (index_position == 0)
+  {
+    error = "The bag has no index. Run 'rosbag reindex' on it.";
+    return false;
+  }
+  if (index_position >= size_)
+  {
+    error = "Truncated bag";
+    return false;
+  }
+
+  // Connections and chunk positions are stored behind the chunks
+  unordered_map<uint32_t, uint32_t> connection_index;
+  for (auto position = index_position; position < size_; position = record.end)
+  {
+    if (!readRecord(bag, size_, position, record) || !readFields(record.header, record.header_size, fields))
+    {
+      error = "Truncated or corrupt index";
+      return false;
+    }
+    if (isOperation(fields, ConnectionRecord))
+    {
+      Connection connection;
+      BagFields connection_header;
+      if (!field(fields, "conn", connection.id) || !field(fields, "topic", connection.topic) ||
+          !readFields(record.data, record.data_size, connection_header) ||
+          !field(connection_header, "type", connection.type))
+      {
+        error = "Corrupt connection record";
+        return false;
+      }
+      if (connection_index.find(connection.id) == connection_index.end())
+      {
+        connection_index[connection.id] = uint32_t(connections_.size());
+        connections_.push_back(connection);
+      }
+    }
+    else if (isOperation(fields, ChunkInfo))
+    {
+      Chunk chunk;
+      if (!field(fields, "chunk_pos", chunk.position))
+      {
+        error = "Corrupt chunk info record";
+        return false;
+      }
+      chunks_.push_back(chunk);
+    }
+  }
+  sort(chunks_.begin(), chunks_.end(), [](const Chunk& a, const Chunk& b) { return a.position < b.position; });
+
+  // Each chunk is followed by the positions of its messages, one index record per connection
+  entries_.assign(connections_.size(), vector<Entry>());
+  for (uint32_t i = 0; i < chunks_.size(); ++i)
+  {
+    auto& chunk = chunks_[i];
+    if (!readRecord(bag, size_, chunk.position, record) || !readFields(record.header, record.header_size, fields) ||
+        !isOperation(fields, ChunkRecord) || !field(fields, "compression", chunk.compression) ||
+        !field(fields, "size", chunk.size))
+    {
+      error = "Truncated or corrupt chunk";
+      return false;
+    }
+    chunk.data = uint64_t(record.data - bag);
+    chunk.data_size = record.data_size;
+    if (chunk.compression != "none" && chunk.size > max_chunk_size)
+    {
+      error = "Chunk too large";
+      return false;
+    }
+
+    for (auto position = record.end; position < size_; position = record.end)
+    {
+      uint32_t version;
+      uint32_t connection;
+      uint32_t count;
+      if (!readRecord(bag, size_, position, record) || !readFields(record.header, record.header_size, fields) ||
+          !isOperation(fields, IndexData))
+      {
+        break;
+      }
+      auto const known = field(fields, "conn", connection) ? connection_index.find(connection) :
+                                                              connection_index.end();
+      if (!field(fields, "ver", version) || version != 1 || !field(fields, "count", count) ||
+          known == connection_index.end() || count > record.data_size / 12)
+      {
+        error = "Corrupt index record";
+        return false;
+      }
+      auto& entries = entries_[known->second];
+      for (uint32_t j = 0; j < count; ++j)
+      {
+        auto const* data = record.data + 12 * j;
+        entries.push_back({ readTime(data), known->second, i, readValue<uint32_t>(data + 8) });
+      }
+    }
+  }
+
+  for (auto& entries : entries_)
+  {
+    stable_sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.time < b.time; });
+  }
+  return true;
+}
+
+void BagReader::close()
+{
+  if (mapping_)
+  {
+    munmap(mapping_, size_);
+    mapping_ = nullptr;
+  }
+  size_ = 0;
+  connections_.clear();
+  chunks_.clear();
+  entries_.clear();
+  has_decompressed_chunk_ = false;
+  decompressed_.clear();
+}
+
+bool BagReader::isOpen() const
+{
+  return mapping_ != nullptr;
+}
+
+vector<BagReader::Topic> BagReader::topics() const
+{
+  vector<Topic> result;
+  for (size_t i = 0; i < connections_.size(); ++i)
+  {
+    auto const& connection = connections_[i];
+    auto existing = find_if(result.begin(), result.end(),
+                            [&connection](const Topic& topic) { return topic.name == connection.topic; });
+    if (existing == result.end())
+    {
+      Topic topic;
+      topic.name = connection.topic;
+      topic.type = connection.type;
+      result.push_back(topic);
+      existing = result.end() - 1;
+    }
+    existing->messages += entries_[i].size();
+  }
+  return result;
+}
+
+string BagReader::topic(const Entry& entry) const
+{
+  return entry.connection < connections_.size() ? connections_[entry.connection].topic : string();
+}
+
+vector<BagReader::Entry> BagReader::messages(const vector<string>& topics) const
+{
+  vector<Entry> result;
+  for (size_t i = 0; i < connections_.size(); ++i)
+  {
+    if (find(topics.begin(), topics.end(), connections_[i].topic) != topics.end())
+    {
+      result.insert(result.end(), entries_[i].begin(), entries_[i].end());
+    }
+  }
+  stable_sort(result.begin(), result.end(), [](const Entry& a, const Entry& b) { return a.time < b.time; });
+  return result;
+}
+
+bool BagReader::read(const Entry& entry, const uint8_t*& data, uint32_t& size, string& error)
+{
+  using namespace internal;
+  const uint8_t* chunk;
+  uint32_t chunk_size;
+  if (!chunkData(entry.chunk, chunk, chunk_size, error))
+  {
+    return false;
+  }
+
+  BagRecord record;
+  BagFields fields;
+  if (!readRecord(chunk, chunk_size, entry.offset, record) || !readFields(record.header, record.header_size, fields) ||
+      !isOperation(fields, MessageData))
+  {
+    error = "Corrupt message record";
+    return false;
+  }
+  data = record.data;
+  size = record.data_size;
+  return true;
+}
+
+bool BagReader::chunkData(uint32_t index, const uint8_t*& data, uint32_t& size, string& error)
+{
+  if (index >= chunks_.size())
+  {
+    error = "Invalid chunk";
+    return false;
+  }
+  auto const& chunk = chunks_[index];
+  auto const* compressed = static_cast<const uint8_t*>(mapping_) + chunk.data;
+  if (chunk.compression == "none")
+  {
+    data = compressed;
+    size = chunk.data_size;
+    return true;
+  }
+
+  if (!has_decompressed_chunk_ || decompressed_chunk_ != index)
+  {
+    has_decompressed_chunk_ = false;
+    decompressed_.resize(chunk.size);
+    unsigned int decompressed_size = chunk.size;
+    // Neither library modifies its input, their interfaces just predate const correctness
+    auto* input = const_cast<char*>(reinterpret_cast<const char*>(compressed));
+    auto* output = reinterpret_cast<char*>(decompressed_.data());
+    bool success = false;
+    if (chunk.compression == "bz2")
+    {
+      success = BZ2_bzBuffToBuffDecompress(output, &decompressed_size, input, chunk.data_size, 0, 0) == BZ_OK;
+    }
+    else if (chunk.compression == "lz4")
+    {
+      success = roslz4_buffToBuffDecompress(input, chunk.data_size, output, &decompressed_size) == ROSLZ4_OK;
+    }
+    else
+    {
+      error = "Unsupported chunk compression " + chunk.compression;
+      return false;
+    }
+    if (!success || decompressed_size != chunk.size)
+    {
+      error = "Failed to decompress " + chunk.compression + " chunk";
+      return false;
+    }
+    decompressed_chunk_ = index;
+    has_decompressed_chunk_ = true;
+  }
+  data = decompressed_.data();
+  size = uint32_t(decompressed_.size());
+  return true;
+}
+
+}  // namespace annotate
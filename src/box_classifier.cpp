@@ -0,0 +1,386 @@
+#include <annotate/box_classifier.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ANNOTATE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace annotate
+{
+namespace internal
+{
+/**
+ * Box bounds rounded to float such that a float comparison against them gives the same result as a double
+ * comparison against the original bounds: lower bounds round up, upper bounds round down.
+ */
+struct FloatBounds
+{
+  float box_min[3];
+  float box_max[3];
+  float nearby_min[3];
+  float nearby_max[3];
+};
+
+float roundUp(double value)
+{
+  auto result = float(value);
+  if (double(result) < value)
+  {
+    result = nextafter(result, numeric_limits<float>::infinity());
+  }
+  return result;
+}
+
+float roundDown(double value)
+{
+  auto result = float(value);
+  if (double(result) > value)
+  {
+    result = nextafter(result, -numeric_limits<float>::infinity());
+  }
+  return result;
+}
+
+FloatBounds floatBounds(const BoxQuery& query)
+{
+  FloatBounds bounds;
+  for (int i = 0; i < 3; ++i)
+  {
+    bounds.box_min[i] = roundUp(query.box_min[i]);
+    bounds.box_max[i] = roundDown(query.box_max[i]);
+    bounds.nearby_min[i] = roundUp(query.nearby_min[i]);
+    bounds.nearby_max[i] = roundDown(query.nearby_max[i]);
+  }
+  return bounds;
+}
+
+void classifyScalar(const BoxQuery& query, const FloatBounds& bounds, float const* x, float const* y, float const* z,
+                    size_t begin, size_t end, BoxClassification& result)
+{
+  auto const& m = query.transform;
+  for (auto i = begin; i < end; ++i)
+  {
+    float const p[3] = { m[0][0] * x[i] + m[0][1] * y[i] + m[0][2] * z[i] + m[0][3],
+                         m[1][0] * x[i] + m[1][1] * y[i] + m[1][2] * z[i] + m[1][3],
+                         m[2][0] * x[i] + m[2][1] * y[i] + m[2][2] * z[i] + m[2][3] };
+    bool nearby = true;
+    bool inside = true;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      nearby = nearby && p[axis] >= bounds.nearby_min[axis] && p[axis] <= bounds.nearby_max[axis];
+      inside = inside && p[axis] >= bounds.box_min[axis] && p[axis] <= bounds.box_max[axis];
+    }
+    if (nearby && inside)
+    {
+      ++result.inside;
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        result.minimum[axis] = min(result.minimum[axis], p[axis]);
+        result.maximum[axis] = max(result.maximum[axis], p[axis]);
+      }
+    }
+    else if (nearby)
+    {
+      ++result.nearby;
+    }
+  }
+}
+
+using Kernel = void (*)(const BoxQuery&, const FloatBounds&, float const*, float const*, float const*, size_t,
+                        BoxClassification&);
+
+void classifyPortable(const BoxQuery& query, const FloatBounds& bounds, float const* x, float const* y,
+                      float const* z, size_t count, BoxClassification& result)
+{
+  classifyScalar(query, bounds, x, y, z, 0u, count, result);
+}
+
+#ifdef ANNOTATE_X86_KERNELS
+void classifySse(const BoxQuery& query, const FloatBounds& bounds, float const* x, float const* y, float const* z,
+                 size_t count, BoxClassification& result)
+{
+  auto const& m = query.transform;
+  __m128 matrix[3][4];
+  __m128 box_min[3], box_max[3], nearby_min[3], nearby_max[3], minimum[3], maximum[3];
+  __m128 const positive = _mm_set1_ps(numeric_limits<float>::infinity());
+  __m128 const negative = _mm_set1_ps(-numeric_limits<float>::infinity());
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    for (int column = 0; column < 4; ++column)
+    {
+      matrix[axis][column] = _mm_set1_ps(m[axis][column]);
+    }
+    box_min[axis] = _mm_set1_ps(bounds.box_min[axis]);
+    box_max[axis] = _mm_set1_ps(bounds.box_max[axis]);
+    nearby_min[axis] = _mm_set1_ps(bounds.nearby_min[axis]);
+    nearby_max[axis] = _mm_set1_ps(bounds.nearby_max[axis]);
+    minimum[axis] = positive;
+    maximum[axis] = negative;
+  }
+
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128 const px = _mm_loadu_ps(x + i);
+    __m128 const py = _mm_loadu_ps(y + i);
+    __m128 const pz = _mm_loadu_ps(z + i);
+    __m128 nearby = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    __m128 inside = nearby;
+    __m128 p[3];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      auto const& row = matrix[axis];
+      p[axis] = _mm_add_ps(
+          _mm_add_ps(_mm_add_ps(_mm_mul_ps(row[0], px), _mm_mul_ps(row[1], py)), _mm_mul_ps(row[2], pz)), row[3]);
+      nearby = _mm_and_ps(nearby, _mm_and_ps(_mm_cmpge_ps(p[axis], nearby_min[axis]),
+                                             _mm_cmple_ps(p[axis], nearby_max[axis])));
+      inside = _mm_and_ps(inside,
+                          _mm_and_ps(_mm_cmpge_ps(p[axis], box_min[axis]), _mm_cmple_ps(p[axis], box_max[axis])));
+    }
+    inside = _mm_and_ps(inside, nearby);
+    int const inside_mask = _mm_movemask_ps(inside);
+    int const nearby_mask = _mm_movemask_ps(nearby) & ~inside_mask;
+    if (inside_mask)
+    {
+      result.inside += __builtin_popcount(inside_mask);
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        __m128 const point = _mm_and_ps(inside, p[axis]);
+        minimum[axis] = _mm_min_ps(minimum[axis], _mm_or_ps(point, _mm_andnot_ps(inside, positive)));
+        maximum[axis] = _mm_max_ps(maximum[axis], _mm_or_ps(point, _mm_andnot_ps(inside, negative)));
+      }
+    }
+    result.nearby += __builtin_popcount(nearby_mask);
+  }
+
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    float lanes[4];
+    _mm_storeu_ps(lanes, minimum[axis]);
+    result.minimum[axis] = min(result.minimum[axis], *min_element(lanes, lanes + 4));
+    _mm_storeu_ps(lanes, maximum[axis]);
+    result.maximum[axis] = max(result.maximum[axis], *max_element(lanes, lanes + 4));
+  }
+  classifyScalar(query, bounds, x, y, z, i, count, result);
+}
+
+__attribute__((target("avx2"))) void classifyAvx2(const BoxQuery& query, const FloatBounds& bounds, float const* x,
+                                                   float const* y, float const* z, size_t count,
+                                                   BoxClassification& result)
+{
+  auto const& m = query.transform;
+  __m256 matrix[3][4];
+  __m256 box_min[3], box_max[3], nearby_min[3], nearby_max[3], minimum[3], maximum[3];
+  __m256 const positive = _mm256_set1_ps(numeric_limits<float>::infinity());
+  __m256 const negative = _mm256_set1_ps(-numeric_limits<float>::infinity());
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    for (int column = 0; column < 4; ++column)
+    {
+      matrix[axis][column] = _mm256_set1_ps(m[axis][column]);
+    }
+    box_min[axis] = _mm256_set1_ps(bounds.box_min[axis]);
+    box_max[axis] = _mm256_set1_ps(bounds.box_max[axis]);
+    nearby_min[axis] = _mm256_set1_ps(bounds.nearby_min[axis]);
+    nearby_max[axis] = _mm256_set1_ps(bounds.nearby_max[axis]);
+    minimum[axis] = positive;
+    maximum[axis] = negative;
+  }
+
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    __m256 const px = _mm256_loadu_ps(x + i);
+    __m256 const py = _mm256_loadu_ps(y + i);
+    __m256 const pz = _mm256_loadu_ps(z + i);
+    __m256 nearby = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    __m256 inside = nearby;
+    __m256 p[3];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      auto const& row = matrix[axis];
+      p[axis] = _mm256_add_ps(
+          _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(row[0], px), _mm256_mul_ps(row[1], py)), _mm256_mul_ps(row[2], pz)),
+          row[3]);
+      nearby = _mm256_and_ps(nearby, _mm256_and_ps(_mm256_cmp_ps(p[axis], nearby_min[axis], _CMP_GE_OQ),
+                                                   _mm256_cmp_ps(p[axis], nearby_max[axis], _CMP_LE_OQ)));
+      inside = _mm256_and_ps(inside, _mm256_and_ps(_mm256_cmp_ps(p[axis], box_min[axis], _CMP_GE_OQ),
+                                                   _mm256_cmp_ps(p[axis], box_max[axis], _CMP_LE_OQ)));
+    }
+    inside = _mm256_and_ps(inside, nearby);
+    int const inside_mask = _mm256_movemask_ps(inside);
+    int const nearby_mask = _mm256_movemask_ps(nearby) & ~inside_mask;
+    if (inside_mask)
+    {
+      result.inside += __builtin_popcount(inside_mask);
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        minimum[axis] = _mm256_min_ps(minimum[axis], _mm256_blendv_ps(positive, p[axis], inside));
+        maximum[axis] = _mm256_max_ps(maximum[axis], _mm256_blendv_ps(negative, p[axis], inside));
+      }
+    }
+    result.nearby += __builtin_popcount(nearby_mask);
+  }
+
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    float lanes[8];
+    _mm256_storeu_ps(lanes, minimum[axis]);
+    result.minimum[axis] = min(result.minimum[axis], *min_element(lanes, lanes + 8));
+    _mm256_storeu_ps(lanes, maximum[axis]);
+    result.maximum[axis] = max(result.maximum[axis], *max_element(lanes, lanes + 8));
+  }
+  classifyScalar(query, bounds, x, y, z, i, count, result);
+}
+
+__attribute__((target("avx512f"))) void classifyAvx512(const BoxQuery& query, const FloatBounds& bounds,
+                                                        float const* x, float const* y, float const* z, size_t count,
+                                                        BoxClassification& result)
+{
+  auto const& m = query.transform;
+  __m512 matrix[3][4];
+  __m512 box_min[3], box_max[3], nearby_min[3], nearby_max[3], minimum[3], maximum[3];
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    for (int column = 0; column < 4; ++column)
+    {
+      matrix[axis][column] = _mm512_set1_ps(m[axis][column]);
+    }
+    box_min[axis] = _mm512_set1_ps(bounds.box_min[axis]);
+    box_max[axis] = _mm512_set1_ps(bounds.box_max[axis]);
+    nearby_min[axis] = _mm512_set1_ps(bounds.nearby_min[axis]);
+    nearby_max[axis] = _mm512_set1_ps(bounds.nearby_max[axis]);
+    minimum[axis] = _mm512_set1_ps(numeric_limits<float>::infinity());
+    maximum[axis] = _mm512_set1_ps(-numeric_limits<float>::infinity());
+  }
+
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16)
+  {
+    __m512 const px = _mm512_loadu_ps(x + i);
+    __m512 const py = _mm512_loadu_ps(y + i);
+    __m512 const pz = _mm512_loadu_ps(z + i);
+    __mmask16 nearby = 0xFFFF;
+    __mmask16 inside = 0xFFFF;
+    __m512 p[3];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      auto const& row = matrix[axis];
+      p[axis] = _mm512_add_ps(
+          _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(row[0], px), _mm512_mul_ps(row[1], py)), _mm512_mul_ps(row[2], pz)),
+          row[3]);
+      nearby &= _mm512_cmp_ps_mask(p[axis], nearby_min[axis], _CMP_GE_OQ) &
+                _mm512_cmp_ps_mask(p[axis], nearby_max[axis], _CMP_LE_OQ);
+      inside &= _mm512_cmp_ps_mask(p[axis], box_min[axis], _CMP_GE_OQ) &
+                _mm512_cmp_ps_mask(p[axis], box_max[axis], _CMP_LE_OQ);
+    }
+    inside &= nearby;
+    if (inside)
+    {
+      result.inside += __builtin_popcount(inside);
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        minimum[axis] = _mm512_mask_min_ps(minimum[axis], inside, minimum[axis], p[axis]);
+        maximum[axis] = _mm512_mask_max_ps(maximum[axis], inside, maximum[axis], p[axis]);
+      }
+    }
+    result.nearby += __builtin_popcount(nearby & ~inside & 0xFFFF);
+  }
+
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    result.minimum[axis] = min(result.minimum[axis], _mm512_reduce_min_ps(minimum[axis]));
+    result.maximum[axis] = max(result.maximum[axis], _mm512_reduce_max_ps(maximum[axis]));
+  }
+  classifyScalar(query, bounds, x, y, z, i, count, result);
+}
+
+Kernel kernel(ClassifierKernel kernel)
+{
+  switch (kernel)
+  {
+    case ClassifierKernel::Scalar:
+      return classifyPortable;
+    case ClassifierKernel::Sse:
+      return classifySse;
+    case ClassifierKernel::Avx2:
+      return classifyAvx2;
+    case ClassifierKernel::Avx512:
+      return classifyAvx512;
+  }
+  return nullptr;
+}
+
+vector<ClassifierKernel> availableKernels()
+{
+  __builtin_cpu_init();
+  vector<ClassifierKernel> kernels = { ClassifierKernel::Scalar, ClassifierKernel::Sse };
+  if (__builtin_cpu_supports("avx2"))
+  {
+    kernels.push_back(ClassifierKernel::Avx2);
+  }
+  if (__builtin_cpu_supports("avx512f"))
+  {
+    kernels.push_back(ClassifierKernel::Avx512);
+  }
+  return kernels;
+}
+#else
+Kernel kernel(ClassifierKernel kernel)
+{
+  return kernel == ClassifierKernel::Scalar ? classifyPortable : nullptr;
+}
+
+vector<ClassifierKernel> availableKernels()
+{
+  return { ClassifierKernel::Scalar };
+}
+#endif
+
+}  // namespace internal
+
+BoxClassification::BoxClassification()
+{
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    minimum[axis] = numeric_limits<float>::infinity();
+    maximum[axis] = -numeric_limits<float>::infinity();
+  }
+}
+
+void classifyPoints(const BoxQuery& query, float const* x, float const* y, float const* z, size_t count,
+                    BoxClassification& result)
+{
+  static internal::Kernel const kernel = internal::kernel(internal::availableKernels().back());
+  kernel(query, internal::floatBounds(query), x, y, z, count, result);
+}
+
+void classifyPointsScalar(const BoxQuery& query, float const* x, float const* y, float const* z, size_t count,
+                          BoxClassification& result)
+{
+  internal::classifyPortable(query, internal::floatBounds(query), x, y, z, count, result);
+}
+
+vector<ClassifierKernel> availableClassifierKernels()
+{
+  return internal::availableKernels();
+}
+
+bool classifyPoints(ClassifierKernel kernel, const BoxQuery& query, float const* x, float const* y, float const* z,
+                    size_t count, BoxClassification& result)
+{
+  auto const available = internal::availableKernels();
+  if (find(available.begin(), available.end(), kernel) == available.end())
+  {
+    return false;
+  }
+  internal::kernel(kernel)(query, internal::floatBounds(query), x, y, z, count, result);
+  return true;
+}
+
+}  // namespace annotate
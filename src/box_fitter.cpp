@@ -0,0 +1,393 @@
+#include <annotate/box_fitter.h>
+#include <annotate/box_classifier.h>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+using namespace tf;
+using namespace std;
+
+namespace annotate
+{
+namespace internal
+{
+/// Points within this distance outside of a box count as nearby
+double const nearby_margin = 0.25;
+
+/// Auto-fit gives up if the box would have to grow by more than this
+double const max_growth = 2.0;
+
+/**
+ * Axis aligned box in the cloud frame containing the given box in the box frame
+ */
+AlignedBox cloudBounds(const Transform& box_to_cloud, const Vector3& minimum, const Vector3& maximum)
+{
+  float const padding = 0.01f;
+  AlignedBox bounds;
+  fill(begin(bounds.minimum), end(bounds.minimum), numeric_limits<float>::max());
+  fill(begin(bounds.maximum), end(bounds.maximum), numeric_limits<float>::lowest());
+  for (int corner = 0; corner < 8; ++corner)
+  {
+    Vector3 const point((corner & 1) ? maximum.x() : minimum.x(), (corner & 2) ? maximum.y() : minimum.y(),
+                        (corner & 4) ? maximum.z() : minimum.z());
+    auto const p = box_to_cloud * point;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      bounds.minimum[axis] = min(bounds.minimum[axis], float(p[axis]) - padding);
+      bounds.maximum[axis] = max(bounds.maximum[axis], float(p[axis]) + padding);
+    }
+  }
+  return bounds;
+}
+
+void snapToGround(BoxSnapshot& box)
+{
+  auto const center = box.cloud_transform.inverse() * box.pose.getOrigin();
+  float height;
+  if (!box.ground->height(float(center.x()), float(center.y()), height))
+  {
+    return;
+  }
+
+  // Ground point below the center in the box frame
+  auto const ground = box.pose.inverse() * (box.cloud_transform * Vector3(center.x(), center.y(), height));
+  double const top = 0.5 * box.size.z();
+  double const bottom = ground.z();
+  if (bottom < top)
+  {
+    box.pose.setOrigin(box.pose * Vector3(0.0, 0.0, 0.5 * (top + bottom)));
+    box.size.setZ(top - bottom);
+  }
+}
+
+/**
+ * Points within [minimum, maximum] in the box frame
+ */
+void collectPoints(const BoxSnapshot& box, const Vector3& minimum, const Vector3& maximum, vector<Vector3>& points)
+{
+  auto const trafo = box.pose.inverseTimes(box.cloud_transform);
+  vector<PointRange> ranges;
+  box.index->query(cloudBounds(trafo.inverse(), minimum, maximum), ranges);
+
+  auto const& index = *box.index;
+  for (auto const& range : ranges)
+  {
+    for (auto i = range.begin; i < range.end; ++i)
+    {
+      auto const p = trafo * Vector3(index.x()[i], index.y()[i], index.z()[i]);
+      if (p.x() >= minimum.x() && p.y() >= minimum.y() && p.z() >= minimum.z() && p.x() <= maximum.x() &&
+          p.y() <= maximum.y() && p.z() <= maximum.z())
+      {
+        points.push_back(p);
+      }
+    }
+  }
+}
+
+double cross(const Vector3& o, const Vector3& a, const Vector3& b)
+{
+  return (a.x() - o.x()) * (b.y() - o.y()) - (a.y() - o.y()) * (b.x() - o.x());
+}
+
+/**
+ * Convex hull of the xy projection of points (monotone chain). Reorders points.
+ */
+vector<Vector3> convexHull(vector<Vector3>& points)
+{
+  sort(points.begin(), points.end(), [](const Vector3& a, const Vector3& b) {
+    return a.x() < b.x() || (a.x() == b.x() && a.y() < b.y());
+  });
+  vector<Vector3> hull(2 * points.size());
+  size_t k = 0;
+  for (size_t i = 0; i < points.size(); ++i)
+  {
+    while (k >= 2 && cross(hull[k - 2], hull[k - 1], points[i]) <= 0.0)
+    {
+      --k;
+    }
+    hull[k++] = points[i];
+  }
+  for (size_t i = points.size() - 1, lower = k + 1; i > 0; --i)
+  {
+    while (k >= lower && cross(hull[k - 2], hull[k - 1], points[i - 1]) <= 0.0)
+    {
+      --k;
+    }
+    hull[k++] = points[i - 1];
+  }
+  hull.resize(k > 1 ? k - 1 : k);
+  return hull;
+}
+
+double normalizeAngle(double angle)
+{
+  return atan2(sin(angle), cos(angle));
+}
+
+}  // namespace internal
+
+PointContext analyzePoints(const BoxSnapshot& box)
+{
+  PointContext context;
+  if (!box.cloud || !box.index || box.cloud->empty())
+  {
+    return context;
+  }
+
+  // Points in the box frame are obtained by combining the cloud transform with the box pose
+  auto const trafo = box.pose.inverseTimes(box.cloud_transform);
+  Vector3 const box_min = -0.5 * box.size;
+  Vector3 const box_max = -box_min;
+  Vector3 offset(internal::nearby_margin, internal::nearby_margin, internal::nearby_margin);
+  Vector3 const nearby_max = box_max + offset;
+  Vector3 nearby_min = box_min - offset;
+  if (box.ignore_ground)
+  {
+    nearby_min.setZ(box_min.z());
+  }
+
+  // Only visit the index cells overlapping the nearby area
+  vector<PointRange> ranges;
+  box.index->query(internal::cloudBounds(trafo.inverse(), nearby_min, nearby_max), ranges);
+
+  BoxQuery query;
+  auto const& basis = trafo.getBasis();
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    for (int column = 0; column < 3; ++column)
+    {
+      query.transform[axis][column] = float(basis[axis][column]);
+    }
+    query.transform[axis][3] = float(trafo.getOrigin()[axis]);
+    query.box_min[axis] = box_min[axis];
+    query.box_max[axis] = box_max[axis];
+    query.nearby_min[axis] = nearby_min[axis];
+    query.nearby_max[axis] = nearby_max[axis];
+  }
+
+  BoxClassification classification;
+  auto const& index = *box.index;
+  for (auto const& range : ranges)
+  {
+    classifyPoints(query, index.x() + range.begin, index.y() + range.begin, index.z() + range.begin,
+                   range.end - range.begin, classification);
+  }
+  context.points_inside = classification.inside;
+  context.points_nearby = classification.nearby;
+  if (classification.inside)
+  {
+    context.minimum.setMin({ classification.minimum[0], classification.minimum[1], classification.minimum[2] });
+    context.maximum.setMax({ classification.maximum[0], classification.maximum[1], classification.maximum[2] });
+  }
+  return context;
+}
+
+void shrinkTo(BoxSnapshot& box, const PointContext& context)
+{
+  if (!context.points_inside)
+  {
+    return;
+  }
+
+  box.pose.setOrigin(box.pose * (0.5 * (context.maximum + context.minimum)));
+  double const offset = 0.05;
+  Vector3 const margin(offset, offset, offset);
+  box.size = margin + context.maximum - context.minimum;
+  if (box.ground)
+  {
+    internal::snapToGround(box);
+  }
+}
+
+bool fitNearbyPoints(BoxSnapshot& box, string& error, const function<bool()>& cancelled)
+{
+  if (cancelled && cancelled())
+  {
+    error = "Cancelled";
+    return false;
+  }
+  if (!box.cloud || !box.index)
+  {
+    error = "No point cloud available";
+    return false;
+  }
+
+  // Growing the box by g (g / 2 on each side) takes in all points whose growth distance d, the growth needed to
+  // contain them, is at most g. A point is nearby if g < d <= g + 2 * margin. Collect the growth distances of all
+  // points that can matter up to the growth limit.
+  Vector3 const half_size = 0.5 * box.size;
+  double const reach = 0.5 * internal::max_growth + internal::nearby_margin;
+  Vector3 search_min = -half_size - Vector3(reach, reach, reach);
+  Vector3 const search_max = half_size + Vector3(reach, reach, reach);
+  if (box.ignore_ground)
+  {
+    // The bottom stays in place and points below it are neither inside nor nearby
+    search_min.setZ(-half_size.z());
+  }
+  vector<Vector3> around;
+  internal::collectPoints(box, search_min, search_max, around);
+  vector<pair<double, Vector3>> points;
+  points.reserve(around.size());
+  for (auto const& p : around)
+  {
+    double growth = 2.0 * max(fabs(p.x()) - half_size.x(), fabs(p.y()) - half_size.y());
+    growth = max(growth, 2.0 * ((box.ignore_ground ? p.z() : fabs(p.z())) - half_size.z()));
+    points.emplace_back(growth, p);
+  }
+
+  if (cancelled && cancelled())
+  {
+    error = "Cancelled";
+    return false;
+  }
+
+  // The smallest growth is either zero or the growth distance of a point followed by a gap of twice the margin
+  sort(points.begin(), points.end(),
+       [](const pair<double, Vector3>& a, const pair<double, Vector3>& b) { return a.first < b.first; });
+  double const gap = 2.0 * internal::nearby_margin;
+  double growth = 0.0;
+  auto inside = points.begin();
+  while (inside != points.end() && inside->first <= growth)
+  {
+    ++inside;
+  }
+  while (inside != points.end() && inside->first <= growth + gap)
+  {
+    growth = inside->first;
+    ++inside;
+    if (growth > internal::max_growth)
+    {
+      stringstream stream;
+      stream << setiosflags(ios::fixed) << setprecision(2);
+      stream << "No gap of " << internal::nearby_margin << " m around the points within " << internal::max_growth
+             << " m of growth";
+      error = stream.str();
+      return false;
+    }
+  }
+
+  PointContext context;
+  for (auto point = points.begin(); point != inside; ++point)
+  {
+    context.minimum.setMin(point->second);
+    context.maximum.setMax(point->second);
+  }
+  context.points_inside = size_t(inside - points.begin());
+  shrinkTo(box, context);
+  return true;
+}
+
+bool fitOrientation(BoxSnapshot& box, double reference_yaw, string& error, const function<bool()>& cancelled)
+{
+  if (!fitNearbyPoints(box, error, cancelled))
+  {
+    return false;
+  }
+
+  vector<Vector3> points;
+  Vector3 const half_size = 0.5 * box.size;
+  internal::collectPoints(box, -half_size, half_size, points);
+  if (points.size() < 3)
+  {
+    error = "Too few points to estimate the orientation";
+    return false;
+  }
+
+  // Candidate orientations are the edges of the convex hull and a one degree grid. A rectangle only has to be
+  // checked modulo 90 degrees. Visible sides are often only two (an L shape), for which a minimum area rectangle is
+  // ambiguous, so rectangles are rated by how close the points are to its nearest side.
+  auto const hull = internal::convexHull(points);
+  vector<double> angles;
+  for (size_t i = 0; i < hull.size(); ++i)
+  {
+    auto const& a = hull[i];
+    auto const& b = hull[(i + 1) % hull.size()];
+    angles.push_back(atan2(b.y() - a.y(), b.x() - a.x()));
+  }
+  for (int degree = 0; degree < 90; ++degree)
+  {
+    angles.push_back(degree * M_PI / 180.0);
+  }
+
+  double best_score = numeric_limits<double>::max();
+  double best_angle = 0.0;
+  double best_length = 0.0;
+  double best_width = 0.0;
+  Vector3 best_center;
+  for (auto const angle : angles)
+  {
+    if (cancelled && cancelled())
+    {
+      error = "Cancelled";
+      return false;
+    }
+
+    double const c = cos(angle);
+    double const s = sin(angle);
+    double min_u = numeric_limits<double>::max();
+    double max_u = numeric_limits<double>::lowest();
+    double min_v = min_u;
+    double max_v = max_u;
+    for (auto const& p : hull)
+    {
+      double const u = c * p.x() + s * p.y();
+      double const v = -s * p.x() + c * p.y();
+      min_u = min(min_u, u);
+      max_u = max(max_u, u);
+      min_v = min(min_v, v);
+      max_v = max(max_v, v);
+    }
+    double score = 0.0;
+    for (auto const& p : points)
+    {
+      double const u = c * p.x() + s * p.y();
+      double const v = -s * p.x() + c * p.y();
+      score += min(min(u - min_u, max_u - u), min(v - min_v, max_v - v));
+    }
+    if (score < best_score)
+    {
+      best_score = score;
+      best_angle = angle;
+      best_length = max_u - min_u;
+      best_width = max_v - min_v;
+      double const u = 0.5 * (min_u + max_u);
+      double const v = 0.5 * (min_v + max_v);
+      best_center.setValue(c * u - s * v, s * u + c * v, 0.0);
+    }
+  }
+
+  // Put the x axis along the longer side, pointing in the direction closest to the reference
+  if (best_width > best_length)
+  {
+    best_angle += 0.5 * M_PI;
+  }
+  double roll;
+  double pitch;
+  double yaw;
+  box.pose.getBasis().getRPY(roll, pitch, yaw);
+  if (fabs(internal::normalizeAngle(yaw + best_angle - reference_yaw)) > 0.5 * M_PI)
+  {
+    best_angle += M_PI;
+  }
+
+  // Start from the rectangle and let the fit settle the extents
+  Quaternion rotation;
+  rotation.setRPY(0.0, 0.0, internal::normalizeAngle(best_angle));
+  auto rotated = box;
+  rotated.pose.setOrigin(box.pose * best_center);
+  rotated.pose.setRotation(box.pose.getRotation() * rotation);
+  if (best_width > best_length)
+  {
+    swap(best_length, best_width);
+  }
+  rotated.size.setValue(best_length, best_width, box.size.z());
+  if (!fitNearbyPoints(rotated, error, cancelled))
+  {
+    return false;
+  }
+  box = rotated;
+  return true;
+}
+
+}  // namespace annotate
@@ -0,0 +1,61 @@
+#include <annotate/cloud_cache.h>
+#include <annotate/point_cloud_reader.h>
+
+using namespace std;
+
+namespace annotate
+{
+CloudCache::CloudCache(const sensor_msgs::PointCloud2& cloud)
+  : frame_id_(cloud.header.frame_id), stamp_(cloud.header.stamp)
+{
+  PointBuffer buffer;
+  if (readPoints(cloud, buffer))
+  {
+    x_.swap(buffer.x);
+    y_.swap(buffer.y);
+    z_.swap(buffer.z);
+  }
+}
+
+CloudCache::CloudCache(const string& frame_id, const ros::Time& stamp, vector<float> x, vector<float> y,
+                       vector<float> z)
+  : frame_id_(frame_id), stamp_(stamp), x_(move(x)), y_(move(y)), z_(move(z))
+{
+}
+
+string const& CloudCache::frameId() const
+{
+  return frame_id_;
+}
+
+ros::Time const& CloudCache::stamp() const
+{
+  return stamp_;
+}
+
+size_t CloudCache::size() const
+{
+  return x_.size();
+}
+
+bool CloudCache::empty() const
+{
+  return x_.empty();
+}
+
+float const* CloudCache::x() const
+{
+  return x_.data();
+}
+
+float const* CloudCache::y() const
+{
+  return y_.data();
+}
+
+float const* CloudCache::z() const
+{
+  return z_.data();
+}
+
+}  // namespace annotate
@@ -0,0 +1,185 @@
+#include <annotate/ground_model.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+
+namespace annotate
+{
+GroundModel::GroundModel(const CloudCache& cloud, float cell_size, float tolerance, float max_slope)
+  : cell_size_(cell_size)
+{
+  auto const size = cloud.size();
+  auto const* x = cloud.x();
+  auto const* y = cloud.y();
+  auto const* z = cloud.z();
+  if (size == 0)
+  {
+    objects_ = make_shared<CloudCache const>(cloud.frameId(), cloud.stamp(), vector<float>(), vector<float>(),
+                                             vector<float>());
+    return;
+  }
+
+  min_x_ = *min_element(x, x + size);
+  min_y_ = *min_element(y, y + size);
+  auto const extent_x = *max_element(x, x + size) - min_x_;
+  auto const extent_y = *max_element(y, y + size) - min_y_;
+
+  // Far away outliers must not blow up the grid
+  size_t const max_cells = size_t(1) << 22;
+  columns_ = size_t(extent_x / cell_size_) + 1;
+  rows_ = size_t(extent_y / cell_size_) + 1;
+  while (columns_ * rows_ > max_cells)
+  {
+    cell_size_ *= 2.0f;
+    columns_ = size_t(extent_x / cell_size_) + 1;
+    rows_ = size_t(extent_y / cell_size_) + 1;
+  }
+
+  auto const infinity = numeric_limits<float>::infinity();
+  vector<float> lowest(columns_ * rows_, infinity);
+  for (size_t i = 0; i < size; ++i)
+  {
+    size_t index;
+    if (cell(x[i], y[i], index))
+    {
+      lowest[index] = min(lowest[index], z[i]);
+    }
+  }
+
+  // The ground rises by at most max_slope per distance. Every cell is lowered to the cone of max_slope over the
+  // lowest point of every other cell. The height under an object is thus bounded by the ground next to it plus the
+  // slope times the distance to that ground, however long the object is. Two raster passes compute the lower
+  // envelope of these cones with chamfer distances.
+  auto const straight = max_slope * cell_size_;
+  auto const diagonal = straight * sqrt(2.0f);
+  vector<float> envelope(lowest);
+  for (size_t row = 0; row < rows_; ++row)
+  {
+    for (size_t column = 0; column < columns_; ++column)
+    {
+      auto const i = row * columns_ + column;
+      auto& height = envelope[i];
+      if (column > 0)
+      {
+        height = min(height, envelope[i - 1] + straight);
+      }
+      if (row > 0)
+      {
+        height = min(height, envelope[i - columns_] + straight);
+        if (column > 0)
+        {
+          height = min(height, envelope[i - columns_ - 1] + diagonal);
+        }
+        if (column + 1 < columns_)
+        {
+          height = min(height, envelope[i - columns_ + 1] + diagonal);
+        }
+      }
+    }
+  }
+  for (size_t row = rows_; row-- > 0;)
+  {
+    for (size_t column = columns_; column-- > 0;)
+    {
+      auto const i = row * columns_ + column;
+      auto& height = envelope[i];
+      if (column + 1 < columns_)
+      {
+        height = min(height, envelope[i + 1] + straight);
+      }
+      if (row + 1 < rows_)
+      {
+        height = min(height, envelope[i + columns_] + straight);
+        if (column + 1 < columns_)
+        {
+          height = min(height, envelope[i + columns_ + 1] + diagonal);
+        }
+        if (column > 0)
+        {
+          height = min(height, envelope[i + columns_ - 1] + diagonal);
+        }
+      }
+    }
+  }
+
+  // Ground is only known next to measured points
+  heights_.assign(lowest.size(), numeric_limits<float>::quiet_NaN());
+  for (size_t row = 0; row < rows_; ++row)
+  {
+    for (size_t column = 0; column < columns_; ++column)
+    {
+      bool known = false;
+      for (size_t r = row ? row - 1 : row; r <= min(row + 1, rows_ - 1); ++r)
+      {
+        for (size_t c = column ? column - 1 : column; c <= min(column + 1, columns_ - 1); ++c)
+        {
+          known = known || lowest[r * columns_ + c] < infinity;
+        }
+      }
+      if (known)
+      {
+        heights_[row * columns_ + column] = envelope[row * columns_ + column];
+      }
+    }
+  }
+
+  vector<float> object_x;
+  vector<float> object_y;
+  vector<float> object_z;
+  object_x.reserve(size);
+  object_y.reserve(size);
+  object_z.reserve(size);
+  for (size_t i = 0; i < size; ++i)
+  {
+    size_t index;
+    if (cell(x[i], y[i], index) && z[i] <= heights_[index] + tolerance)
+    {
+      ++ground_points_;
+    }
+    else
+    {
+      object_x.push_back(x[i]);
+      object_y.push_back(y[i]);
+      object_z.push_back(z[i]);
+    }
+  }
+  objects_ = make_shared<CloudCache const>(cloud.frameId(), cloud.stamp(), move(object_x), move(object_y),
+                                           move(object_z));
+}
+
+bool GroundModel::height(float x, float y, float& z) const
+{
+  size_t index;
+  if (!cell(x, y, index) || std::isnan(heights_[index]))
+  {
+    return false;
+  }
+  z = heights_[index];
+  return true;
+}
+
+CloudCache::Ptr GroundModel::objects() const
+{
+  return objects_;
+}
+
+size_t GroundModel::groundPoints() const
+{
+  return ground_points_;
+}
+
+bool GroundModel::cell(float x, float y, size_t& index) const
+{
+  auto const column = floor((x - min_x_) / cell_size_);
+  auto const row = floor((y - min_y_) / cell_size_);
+  if (!(column >= 0.0f && row >= 0.0f && column < columns_ && row < rows_))
+  {
+    return false;
+  }
+  index = size_t(row) * columns_ + size_t(column);
+  return true;
+}
+
+}  // namespace annotate
@@ -0,0 +1,173 @@
+#include <annotate/latency_monitor.h>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace annotate
+{
+LatencyMonitor::Timer::Timer(LatencyMonitor& monitor, Section section)
+  : monitor_(monitor), section_(section), running_(monitor.enabled())
+{
+  if (running_)
+  {
+    start_ = chrono::steady_clock::now();
+  }
+}
+
+LatencyMonitor::Timer::~Timer()
+{
+  if (running_)
+  {
+    monitor_.record(section_, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_));
+  }
+}
+
+LatencyMonitor::LatencyMonitor(size_t periods)
+{
+  periods_.resize(max<size_t>(1, periods));
+  period_maximum_.resize(periods_.size());
+  clear();
+}
+
+void LatencyMonitor::setEnabled(bool enabled)
+{
+  enabled_.store(enabled, memory_order_relaxed);
+}
+
+bool LatencyMonitor::enabled() const
+{
+  return enabled_.load(memory_order_relaxed);
+}
+
+void LatencyMonitor::record(Section section, chrono::nanoseconds duration)
+{
+  current_[section][bucket(duration)].fetch_add(1, memory_order_relaxed);
+  auto const nanoseconds = uint64_t(max<chrono::nanoseconds::rep>(0, duration.count()));
+  auto& maximum = maximum_[section];
+  auto previous = maximum.load(memory_order_relaxed);
+  while (previous < nanoseconds && !maximum.compare_exchange_weak(previous, nanoseconds, memory_order_relaxed))
+  {
+  }
+}
+
+void LatencyMonitor::advance()
+{
+  period_ = (period_ + 1) % periods_.size();
+  for (size_t section = 0; section < Sections; ++section)
+  {
+    auto& counts = periods_[period_][section];
+    for (size_t i = 0; i < buckets; ++i)
+    {
+      counts[i] = current_[section][i].exchange(0, memory_order_relaxed);
+    }
+    period_maximum_[period_][section] = maximum_[section].exchange(0, memory_order_relaxed);
+  }
+}
+
+LatencyMonitor::Statistics LatencyMonitor::statistics(Section section) const
+{
+  Counts counts;
+  counts.fill(0);
+  uint64_t maximum = 0;
+  for (size_t period = 0; period < periods_.size(); ++period)
+  {
+    for (size_t i = 0; i < buckets; ++i)
+    {
+      counts[i] += periods_[period][section][i];
+    }
+    maximum = max(maximum, period_maximum_[period][section]);
+  }
+
+  Statistics result;
+  for (auto const count : counts)
+  {
+    result.count += count;
+  }
+  if (result.count == 0)
+  {
+    return result;
+  }
+
+  result.maximum = maximum * 1e-9;
+  // Bucket bounds overestimate, but never beyond the slowest duration seen
+  auto const percentile = [&](double fraction) {
+    auto const rank = size_t(ceil(fraction * result.count));
+    size_t seen = 0;
+    for (size_t i = 0; i < buckets; ++i)
+    {
+      seen += counts[i];
+      if (seen >= rank)
+      {
+        return min(upperBound(i), result.maximum);
+      }
+    }
+    return result.maximum;
+  };
+  result.p50 = percentile(0.50);
+  result.p95 = percentile(0.95);
+  result.p99 = percentile(0.99);
+  return result;
+}
+
+void LatencyMonitor::clear()
+{
+  for (size_t section = 0; section < Sections; ++section)
+  {
+    for (auto& count : current_[section])
+    {
+      count.store(0, memory_order_relaxed);
+    }
+    maximum_[section].store(0, memory_order_relaxed);
+  }
+  for (size_t period = 0; period < periods_.size(); ++period)
+  {
+    for (auto& counts : periods_[period])
+    {
+      counts.fill(0);
+    }
+    period_maximum_[period].fill(0);
+  }
+}
+
+string LatencyMonitor::name(Section section)
+{
+  switch (section)
+  {
+    case HandlePointcloud:
+      return "handlePointcloud";
+    case AnalyzePoints:
+      return "analyzePoints";
+    case FitNearbyPoints:
+      return "fitNearbyPoints";
+    case Save:
+      return "save";
+    case Load:
+      return "load";
+    case PublishTrackMarkers:
+      return "publishTrackMarkers";
+    case Push:
+      return "push";
+    case Sections:
+      break;
+  }
+  return "unknown";
+}
+
+size_t LatencyMonitor::bucket(chrono::nanoseconds duration)
+{
+  // Bucket 0 holds everything below a microsecond, bucket i up to 2^(i/4) microseconds
+  auto const microseconds = duration.count() * 1e-3;
+  if (microseconds <= 1.0)
+  {
+    return 0;
+  }
+  return min(buckets - 1, size_t(ceil(4.0 * log2(microseconds))));
+}
+
+double LatencyMonitor::upperBound(size_t bucket)
+{
+  return pow(2.0, bucket / 4.0) * 1e-6;
+}
+
+}  // namespace annotate
@@ -0,0 +1,175 @@
+#include <annotate/point_cloud_reader.h>
+#include <limits>
+
+using namespace std;
+using sensor_msgs::PointField;
+
+namespace annotate
+{
+namespace internal
+{
+template <typename T>
+double loadValue(uint8_t const* data, bool swap_bytes)
+{
+  uint8_t bytes[sizeof(T)];
+  memcpy(bytes, data, sizeof(T));
+  if (swap_bytes)
+  {
+    reverse(bytes, bytes + sizeof(T));
+  }
+  T value;
+  memcpy(&value, bytes, sizeof(T));
+  return double(value);
+}
+
+double loadValue(uint8_t const* data, uint8_t datatype, bool swap_bytes)
+{
+  switch (datatype)
+  {
+    case PointField::INT8:
+      return loadValue<int8_t>(data, swap_bytes);
+    case PointField::UINT8:
+      return loadValue<uint8_t>(data, swap_bytes);
+    case PointField::INT16:
+      return loadValue<int16_t>(data, swap_bytes);
+    case PointField::UINT16:
+      return loadValue<uint16_t>(data, swap_bytes);
+    case PointField::INT32:
+      return loadValue<int32_t>(data, swap_bytes);
+    case PointField::UINT32:
+      return loadValue<uint32_t>(data, swap_bytes);
+    case PointField::FLOAT32:
+      return loadValue<float>(data, swap_bytes);
+    case PointField::FLOAT64:
+      return loadValue<double>(data, swap_bytes);
+  }
+  return numeric_limits<double>::quiet_NaN();
+}
+
+bool hostIsBigEndian()
+{
+  uint16_t const value = 1;
+  uint8_t first;
+  memcpy(&first, &value, 1);
+  return first == 0;
+}
+
+size_t fieldSize(uint8_t datatype)
+{
+  switch (datatype)
+  {
+    case PointField::INT8:
+    case PointField::UINT8:
+      return 1;
+    case PointField::INT16:
+    case PointField::UINT16:
+      return 2;
+    case PointField::INT32:
+    case PointField::UINT32:
+    case PointField::FLOAT32:
+      return 4;
+    case PointField::FLOAT64:
+      return 8;
+  }
+  return 0;
+}
+
+void readConverted(const sensor_msgs::PointCloud2& cloud, PointField const* const fields[3], PointBuffer& buffer)
+{
+  bool const swap_bytes = bool(cloud.is_bigendian) != hostIsBigEndian();
+  uint32_t const height = max(1u, cloud.height);
+  for (uint32_t row = 0; row < height; ++row)
+  {
+    size_t const row_start = size_t(row) * cloud.row_step;
+    if (row_start >= cloud.data.size())
+    {
+      return;
+    }
+    size_t const available = (cloud.data.size() - row_start) / cloud.point_step;
+    size_t const width = min(size_t(cloud.width), available);
+    uint8_t const* point = cloud.data.data() + row_start;
+    for (size_t i = 0; i < width; ++i, point += cloud.point_step)
+    {
+      buffer.append(float(loadValue(point + fields[0]->offset, fields[0]->datatype, swap_bytes)),
+                    float(loadValue(point + fields[1]->offset, fields[1]->datatype, swap_bytes)),
+                    float(loadValue(point + fields[2]->offset, fields[2]->datatype, swap_bytes)));
+    }
+  }
+}
+
+}  // namespace internal
+
+bool readPoints(const sensor_msgs::PointCloud2& cloud, PointBuffer& buffer)
+{
+  PointField const* fields[3] = { nullptr, nullptr, nullptr };
+  for (auto const& field : cloud.fields)
+  {
+    if (field.name == "x")
+    {
+      fields[0] = &field;
+    }
+    else if (field.name == "y")
+    {
+      fields[1] = &field;
+    }
+    else if (field.name == "z")
+    {
+      fields[2] = &field;
+    }
+  }
+  if (!fields[0] || !fields[1] || !fields[2] || cloud.point_step == 0)
+  {
+    return false;
+  }
+  for (auto const* field : fields)
+  {
+    if (field->offset + internal::fieldSize(field->datatype) > cloud.point_step)
+    {
+      return false;
+    }
+  }
+
+  size_t const points = size_t(max(1u, cloud.height)) * cloud.width;
+  buffer.x.reserve(buffer.x.size() + points);
+  buffer.y.reserve(buffer.y.size() + points);
+  buffer.z.reserve(buffer.z.size() + points);
+
+  bool const native = bool(cloud.is_bigendian) == internal::hostIsBigEndian();
+  auto const datatype = fields[0]->datatype;
+  bool const same_type = fields[1]->datatype == datatype && fields[2]->datatype == datatype;
+  if (!native || !same_type)
+  {
+    internal::readConverted(cloud, fields, buffer);
+  }
+  else if (datatype == PointField::FLOAT32)
+  {
+    bool const packed = fields[0]->offset == 0 && fields[1]->offset == 4 && fields[2]->offset == 8;
+    if (packed && cloud.point_step == 16)
+    {
+      PointCloudReader<float, 16>(cloud, 0, 4, 8).read(buffer);
+    }
+    else if (packed && cloud.point_step == 32)
+    {
+      PointCloudReader<float, 32>(cloud, 0, 4, 8).read(buffer);
+    }
+    else if (packed && cloud.point_step == 48)
+    {
+      PointCloudReader<float, 48>(cloud, 0, 4, 8).read(buffer);
+    }
+    else
+    {
+      PointCloudReader<float>(cloud, fields[0]->offset, fields[1]->offset, fields[2]->offset).read(buffer);
+    }
+  }
+  else if (datatype == PointField::FLOAT64)
+  {
+    PointCloudReader<double>(cloud, fields[0]->offset, fields[1]->offset, fields[2]->offset).read(buffer);
+  }
+  else
+  {
+    internal::readConverted(cloud, fields, buffer);
+  }
+  return true;
+}
+
+}  // namespace annotate
@@ -0,0 +1,255 @@
+#include <annotate/spatial_index.h>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <unordered_map>
+
+using namespace std;
+
+namespace annotate
+{
+namespace internal
+{
+class VoxelHashIndex : public SpatialIndex
+{
+public:
+  explicit VoxelHashIndex(const CloudCache& cloud)
+  {
+    vector<pair<uint64_t, uint32_t>> keys(cloud.size());
+    for (size_t i = 0; i < cloud.size(); ++i)
+    {
+      keys[i] = { key(cell(cloud.x()[i]), cell(cloud.y()[i]), cell(cloud.z()[i])), uint32_t(i) };
+    }
+    sort(keys.begin(), keys.end());
+
+    vector<uint32_t> order(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+      order[i] = keys[i].second;
+      if (i == 0 || keys[i].first != keys[i - 1].first)
+      {
+        cells_[keys[i].first] = { uint32_t(i), uint32_t(i) };
+      }
+      ++cells_[keys[i].first].end;
+    }
+    reorder(cloud, order);
+  }
+
+  void query(const AlignedBox& box, vector<PointRange>& ranges) const override
+  {
+    int32_t low[3];
+    int32_t high[3];
+    size_t cells = 1;
+    for (int i = 0; i < 3; ++i)
+    {
+      low[i] = cell(box.minimum[i]);
+      high[i] = cell(box.maximum[i]);
+      cells *= size_t(high[i] - low[i] + 1);
+    }
+
+    if (cells > cells_.size())
+    {
+      // Cheaper to test every occupied cell than every cell covered by the box
+      for (auto const& entry : cells_)
+      {
+        int32_t const c[3] = { int32_t(entry.first >> 42) - offset, int32_t((entry.first >> 21) & mask) - offset,
+                               int32_t(entry.first & mask) - offset };
+        if (c[0] >= low[0] && c[0] <= high[0] && c[1] >= low[1] && c[1] <= high[1] && c[2] >= low[2] &&
+            c[2] <= high[2])
+        {
+          append(ranges, entry.second.begin, entry.second.end);
+        }
+      }
+      return;
+    }
+
+    for (int32_t x = low[0]; x <= high[0]; ++x)
+    {
+      for (int32_t y = low[1]; y <= high[1]; ++y)
+      {
+        for (int32_t z = low[2]; z <= high[2]; ++z)
+        {
+          auto const iter = cells_.find(key(x, y, z));
+          if (iter != cells_.end())
+          {
+            append(ranges, iter->second.begin, iter->second.end);
+          }
+        }
+      }
+    }
+  }
+
+private:
+  static constexpr float cell_size = 0.5f;
+  static constexpr int32_t offset = 1 << 20;
+  static constexpr uint64_t mask = (uint64_t(1) << 21) - 1;
+
+  static int32_t cell(float value)
+  {
+    auto const c = floor(value / cell_size);
+    return int32_t(max(-float(offset), min(float(offset - 1), c)));
+  }
+
+  static uint64_t key(int32_t x, int32_t y, int32_t z)
+  {
+    return (uint64_t(x + offset) << 42) | (uint64_t(y + offset) << 21) | uint64_t(z + offset);
+  }
+
+  unordered_map<uint64_t, PointRange> cells_;
+};
+
+class KdTreeIndex : public SpatialIndex
+{
+public:
+  explicit KdTreeIndex(const CloudCache& cloud)
+  {
+    vector<uint32_t> order(cloud.size());
+    iota(order.begin(), order.end(), 0u);
+    float const* coordinates[3] = { cloud.x(), cloud.y(), cloud.z() };
+    if (!order.empty())
+    {
+      build(coordinates, order, 0u, uint32_t(order.size()));
+    }
+    reorder(cloud, order);
+  }
+
+  void query(const AlignedBox& box, vector<PointRange>& ranges) const override
+  {
+    if (!nodes_.empty())
+    {
+      query(box, 0u, ranges);
+    }
+  }
+
+private:
+  struct Node
+  {
+    PointRange range;
+    float split;
+    int axis;  // -1 for leaves
+    uint32_t right;
+  };
+
+  static constexpr uint32_t leaf_size = 32;
+
+  void build(float const* const coordinates[3], vector<uint32_t>& order, uint32_t begin, uint32_t end)
+  {
+    auto const index = nodes_.size();
+    nodes_.push_back({ { begin, end }, 0.0f, -1, 0u });
+    if (end - begin <= leaf_size)
+    {
+      return;
+    }
+
+    float low[3] = { coordinates[0][order[begin]], coordinates[1][order[begin]], coordinates[2][order[begin]] };
+    float high[3] = { low[0], low[1], low[2] };
+    for (auto i = begin + 1; i < end; ++i)
+    {
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        low[axis] = min(low[axis], coordinates[axis][order[i]]);
+        high[axis] = max(high[axis], coordinates[axis][order[i]]);
+      }
+    }
+    int axis = 0;
+    for (int a = 1; a < 3; ++a)
+    {
+      if (high[a] - low[a] > high[axis] - low[axis])
+      {
+        axis = a;
+      }
+    }
+
+    auto const middle = begin + (end - begin) / 2;
+    float const* values = coordinates[axis];
+    nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+                [values](uint32_t a, uint32_t b) { return values[a] < values[b]; });
+    nodes_[index].split = values[order[middle]];
+    nodes_[index].axis = axis;
+    build(coordinates, order, begin, middle);
+    nodes_[index].right = uint32_t(nodes_.size());
+    build(coordinates, order, middle, end);
+  }
+
+  void query(const AlignedBox& box, uint32_t index, vector<PointRange>& ranges) const
+  {
+    auto const& node = nodes_[index];
+    if (node.axis < 0)
+    {
+      append(ranges, node.range.begin, node.range.end);
+      return;
+    }
+    // Points left of the split have coordinates <= split, points right of it >= split
+    if (box.minimum[node.axis] <= node.split)
+    {
+      query(box, index + 1, ranges);
+    }
+    if (box.maximum[node.axis] >= node.split)
+    {
+      query(box, node.right, ranges);
+    }
+  }
+
+  vector<Node> nodes_;
+};
+
+}  // namespace internal
+
+SpatialIndex::Ptr SpatialIndex::create(Type type, const CloudCache& cloud)
+{
+  switch (type)
+  {
+    case KdTree:
+      return make_shared<internal::KdTreeIndex>(cloud);
+    case VoxelHash:
+      break;
+  }
+  return make_shared<internal::VoxelHashIndex>(cloud);
+}
+
+size_t SpatialIndex::size() const
+{
+  return x_.size();
+}
+
+float const* SpatialIndex::x() const
+{
+  return x_.data();
+}
+
+float const* SpatialIndex::y() const
+{
+  return y_.data();
+}
+
+float const* SpatialIndex::z() const
+{
+  return z_.data();
+}
+
+void SpatialIndex::reorder(const CloudCache& cloud, const vector<uint32_t>& order)
+{
+  x_.resize(order.size());
+  y_.resize(order.size());
+  z_.resize(order.size());
+  for (size_t i = 0; i < order.size(); ++i)
+  {
+    x_[i] = cloud.x()[order[i]];
+    y_[i] = cloud.y()[order[i]];
+    z_[i] = cloud.z()[order[i]];
+  }
+}
+
+void SpatialIndex::append(vector<PointRange>& ranges, uint32_t begin, uint32_t end)
+{
+  if (!ranges.empty() && ranges.back().end == begin)
+  {
+    ranges.back().end = end;
+  }
+  else
+  {
+    ranges.push_back({ begin, end });
+  }
+}
+
+}  // namespace annotate
@@ -0,0 +1,231 @@
+#include <annotate/trace_recorder.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace annotate
+{
+namespace internal
+{
+atomic<uint64_t> next_trace_recorder_id{ 1 };
+
+/// The buffer the calling thread used last, identified by the id of its recorder
+struct ThreadBuffer
+{
+  uint64_t recorder_id{ 0 };
+  void* buffer{ nullptr };
+};
+
+thread_local ThreadBuffer thread_buffer;
+
+string escape(const string& text)
+{
+  stringstream stream;
+  for (auto const c : text)
+  {
+    if (c == '"' || c == '\\')
+    {
+      stream << '\\' << c;
+    }
+    else if (static_cast<unsigned char>(c) < 0x20)
+    {
+      stream << "\\u" << hex << setw(4) << setfill('0') << int(c) << dec;
+    }
+    else
+    {
+      stream << c;
+    }
+  }
+  return stream.str();
+}
+
+}  // namespace internal
+
+TraceRecorder::Scope::Scope(TraceRecorder& recorder, const char* name, int64_t marker_id)
+  : recorder_(recorder), name_(name), marker_id_(marker_id)
+{
+  if (recorder_.enabled())
+  {
+    begin_ = now();
+  }
+}
+
+TraceRecorder::Scope::~Scope()
+{
+  if (begin_ >= 0)
+  {
+    recorder_.record(name_, marker_id_, begin_, now());
+  }
+}
+
+TraceRecorder::TraceRecorder(size_t events_per_thread)
+  : id_(internal::next_trace_recorder_id++), capacity_(max<size_t>(1, events_per_thread))
+{
+}
+
+void TraceRecorder::setEnabled(bool enabled)
+{
+  enabled_.store(enabled, memory_order_relaxed);
+}
+
+bool TraceRecorder::enabled() const
+{
+  return enabled_.load(memory_order_relaxed);
+}
+
+void TraceRecorder::record(const char* name, int64_t marker_id, int64_t begin, int64_t end)
+{
+  auto& target = buffer();
+  // Only this thread writes to the buffer. Announcing the write before overwriting the oldest event lets readers
+  // detect events that changed while they copied them.
+  auto const index = target.written.load(memory_order_relaxed);
+  auto& event = target.events[index % target.events.size()];
+  target.started.store(index + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  event.name.store(name, memory_order_relaxed);
+  event.marker_id.store(marker_id, memory_order_relaxed);
+  event.begin.store(begin, memory_order_relaxed);
+  event.end.store(end, memory_order_relaxed);
+  target.written.store(index + 1, memory_order_release);
+}
+
+void TraceRecorder::setThreadName(const string& name)
+{
+  auto& target = buffer();
+  lock_guard<mutex> lock(mutex_);
+  target.thread_name = name;
+}
+
+size_t TraceRecorder::events() const
+{
+  lock_guard<mutex> lock(mutex_);
+  size_t result = 0;
+  for (auto const& buffer : buffers_)
+  {
+    result += min<uint64_t>(buffer->written.load(memory_order_acquire), buffer->events.size());
+  }
+  return result;
+}
+
+bool TraceRecorder::write(const string& file, string& error) const
+{
+  struct Copy
+  {
+    const char* name;
+    int64_t marker_id;
+    int64_t begin;
+    int64_t end;
+  };
+
+  auto const temporary_file = file + ".tmp";
+  ofstream stream(temporary_file);
+  if (!stream.is_open())
+  {
+    error = "Failed to open " + file + " for writing the trace.";
+    return false;
+  }
+
+  auto const process_id = getpid();
+  stream << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  stream << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << process_id
+         << ",\"args\":{\"name\":\"annotate\"}}";
+  stream << fixed << setprecision(3);
+  vector<shared_ptr<Buffer>> buffers;
+  {
+    lock_guard<mutex> lock(mutex_);
+    buffers = buffers_;
+    for (auto const& buffer : buffers)
+    {
+      if (!buffer->thread_name.empty())
+      {
+        stream << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << process_id << ",\"tid\":" << buffer->thread_id
+               << ",\"args\":{\"name\":\"" << internal::escape(buffer->thread_name) << "\"}}";
+      }
+    }
+  }
+
+  vector<Copy> events;
+  for (auto const& buffer : buffers)
+  {
+    auto const size = buffer->events.size();
+    auto const end = buffer->written.load(memory_order_acquire);
+    auto const begin = end > size ? end - size : 0;
+    events.clear();
+    for (auto index = begin; index < end; ++index)
+    {
+      auto const& event = buffer->events[index % size];
+      events.push_back({ event.name.load(memory_order_relaxed), event.marker_id.load(memory_order_relaxed),
+                         event.begin.load(memory_order_relaxed), event.end.load(memory_order_relaxed) });
+    }
+
+    // Events the thread started to overwrite meanwhile may be torn
+    atomic_thread_fence(memory_order_acquire);
+    auto const started = buffer->started.load(memory_order_relaxed);
+    auto const valid_from = started > size ? started - size : 0;
+    for (size_t i = 0; i < events.size(); ++i)
+    {
+      auto const& event = events[i];
+      if (begin + i < valid_from || event.name == nullptr)
+      {
+        continue;
+      }
+      stream << ",\n{\"name\":\"" << internal::escape(event.name) << "\",\"cat\":\"annotate\",\"ph\":\"X\",\"ts\":"
+             << event.begin * 1e-3 << ",\"dur\":" << (event.end - event.begin) * 1e-3 << ",\"pid\":" << process_id
+             << ",\"tid\":" << buffer->thread_id;
+      if (event.marker_id >= 0)
+      {
+        stream << ",\"args\":{\"marker\":" << event.marker_id << "}";
+      }
+      stream << "}";
+    }
+  }
+  stream << "\n]}\n";
+  stream.close();
+
+  if (stream.fail() || rename(temporary_file.c_str(), file.c_str()) != 0)
+  {
+    remove(temporary_file.c_str());
+    error = "Failed to write the trace to " + file;
+    return false;
+  }
+  return true;
+}
+
+int64_t TraceRecorder::now()
+{
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+TraceRecorder::Buffer& TraceRecorder::buffer()
+{
+  auto& cached = internal::thread_buffer;
+  if (cached.recorder_id != id_)
+  {
+    int64_t const thread_id = syscall(SYS_gettid);
+    lock_guard<mutex> lock(mutex_);
+    auto const existing = find_if(buffers_.begin(), buffers_.end(), [thread_id](const shared_ptr<Buffer>& buffer) {
+      return buffer->thread_id == thread_id;
+    });
+    if (existing == buffers_.end())
+    {
+      buffers_.push_back(make_shared<Buffer>(capacity_));
+      buffers_.back()->thread_id = thread_id;
+      cached.buffer = buffers_.back().get();
+    }
+    else
+    {
+      cached.buffer = existing->get();
+    }
+    cached.recorder_id = id_;
+  }
+  return *static_cast<Buffer*>(cached.buffer);
+}
+
+}  // namespace annotate
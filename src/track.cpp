@@ -0,0 +1,150 @@
+#include <annotate/track.h>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace annotate
+{
+double TrackInstance::timeTo(ros::Time const& time) const
+{
+  return std::fabs((time - center.stamp_).toSec());
+}
+
+void Track::insert(const TrackInstance& instance)
+{
+  auto const& stamp = instance.center.stamp_;
+  if (instances_.empty() || instances_.back().center.stamp_ < stamp)
+  {
+    instances_.push_back(instance);
+    return;
+  }
+
+  auto const position = lowerBound(stamp);
+  if (position != instances_.end() && position->center.stamp_ == stamp)
+  {
+    instances_[size_t(position - instances_.begin())] = instance;
+  }
+  else
+  {
+    instances_.insert(position, instance);
+  }
+}
+
+void Track::reserve(size_t size)
+{
+  instances_.reserve(size);
+}
+
+void Track::clear()
+{
+  instances_.clear();
+}
+
+bool Track::empty() const
+{
+  return instances_.empty();
+}
+
+size_t Track::size() const
+{
+  return instances_.size();
+}
+
+Track::const_iterator Track::begin() const
+{
+  return instances_.begin();
+}
+
+Track::const_iterator Track::end() const
+{
+  return instances_.end();
+}
+
+const TrackInstance& Track::front() const
+{
+  return instances_.front();
+}
+
+const TrackInstance& Track::back() const
+{
+  return instances_.back();
+}
+
+Track::const_iterator Track::lowerBound(const ros::Time& time) const
+{
+  return lower_bound(instances_.begin(), instances_.end(), time,
+                     [](TrackInstance const& instance, ros::Time const& t) { return instance.center.stamp_ < t; });
+}
+
+const TrackInstance* Track::find(const ros::Time& time, double tolerance) const
+{
+  auto const position = lowerBound(time);
+  const TrackInstance* result = nullptr;
+  if (position != instances_.end() && position->timeTo(time) < tolerance)
+  {
+    result = &*position;
+  }
+  if (position != instances_.begin())
+  {
+    auto const& previous = *(position - 1);
+    if (previous.timeTo(time) < tolerance && (!result || previous.timeTo(time) <= result->timeTo(time)))
+    {
+      result = &previous;
+    }
+  }
+  return result;
+}
+
+bool Track::nearest(const ros::Time& time, const TrackInstance*& first, const TrackInstance*& second) const
+{
+  if (instances_.size() < 2)
+  {
+    return false;
+  }
+
+  // The closest instances are adjacent to the insert position of time
+  auto right = lowerBound(time);
+  auto left = right;
+  const TrackInstance* closest[2];
+  for (auto& result : closest)
+  {
+    bool const take_left =
+        right == instances_.end() || (left != instances_.begin() && (left - 1)->timeTo(time) <= right->timeTo(time));
+    if (take_left)
+    {
+      --left;
+      result = &*left;
+    }
+    else
+    {
+      result = &*right;
+      ++right;
+    }
+  }
+  first = closest[0];
+  second = closest[1];
+  return true;
+}
+
+pair<Track::const_iterator, Track::const_iterator> Track::range(const ros::Time& begin, const ros::Time& end) const
+{
+  auto const first = lowerBound(begin);
+  auto const last = upper_bound(first, instances_.end(), end, [](ros::Time const& t, TrackInstance const& instance) {
+    return t < instance.center.stamp_;
+  });
+  return make_pair(first, last);
+}
+
+bool spans(const Track& track, const ros::Time& time, double margin)
+{
+  if (track.empty())
+  {
+    return false;
+  }
+  auto const before_start = time < track.front().center.stamp_ && track.front().timeTo(time) > margin;
+  auto const after_end = time > track.back().center.stamp_ && track.back().timeTo(time) > margin;
+  return !before_start && !after_end;
+}
+
+}  // namespace annotate
@@ -0,0 +1,77 @@
+#include <annotate/track_span_index.h>
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+namespace annotate
+{
+void TrackSpanIndex::clear()
+{
+  spans_.clear();
+  latest_end_.clear();
+}
+
+void TrackSpanIndex::insert(int id, double begin, double end)
+{
+  spans_.push_back({ begin, end, id });
+}
+
+void TrackSpanIndex::build()
+{
+  sort(spans_.begin(), spans_.end(), [](Span const& a, Span const& b) { return a.begin < b.begin; });
+  latest_end_.resize(spans_.size());
+  build(0, spans_.size());
+}
+
+bool TrackSpanIndex::empty() const
+{
+  return spans_.empty();
+}
+
+double TrackSpanIndex::build(size_t begin, size_t end)
+{
+  if (begin >= end)
+  {
+    return -numeric_limits<double>::infinity();
+  }
+  // The middle element of each range is the root of its subtree
+  auto const middle = begin + (end - begin) / 2;
+  auto const latest = max({ spans_[middle].end, build(begin, middle), build(middle + 1, end) });
+  latest_end_[middle] = latest;
+  return latest;
+}
+
+void TrackSpanIndex::query(double begin, double end, vector<int>& ids) const
+{
+  ids.clear();
+  query(0, spans_.size(), begin, end, ids);
+}
+
+void TrackSpanIndex::query(size_t begin, size_t end, double query_begin, double query_end, vector<int>& ids) const
+{
+  if (begin >= end)
+  {
+    return;
+  }
+  auto const middle = begin + (end - begin) / 2;
+  if (latest_end_[middle] < query_begin)
+  {
+    // Everything in this subtree ends too early
+    return;
+  }
+  query(begin, middle, query_begin, query_end, ids);
+  auto const& span = spans_[middle];
+  if (span.begin > query_end)
+  {
+    // The right subtree starts even later
+    return;
+  }
+  if (span.end >= query_begin)
+  {
+    ids.push_back(span.id);
+  }
+  query(middle + 1, end, query_begin, query_end, ids);
+}
+
+}  // namespace annotate
@@ -0,0 +1,42 @@
+#include <annotate/update_batcher.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace annotate
+{
+UpdateBatcher::UpdateBatcher(const shared_ptr<interactive_markers::InteractiveMarkerServer>& server, QObject* parent)
+  : QObject(parent), server_(server)
+{
+  timer_.setSingleShot(true);
+  connect(&timer_, SIGNAL(timeout()), this, SLOT(flush()));
+}
+
+void UpdateBatcher::schedule()
+{
+  if (timer_.isActive())
+  {
+    return;
+  }
+
+  int delay = 0;
+  if (minimum_interval_ > 0 && last_flush_.isValid())
+  {
+    delay = max(0, minimum_interval_ - int(last_flush_.elapsed()));
+  }
+  timer_.start(delay);
+}
+
+void UpdateBatcher::setMaximumRate(double rate)
+{
+  minimum_interval_ = rate > 0.0 ? int(1000.0 / rate) : 0;
+}
+
+void UpdateBatcher::flush()
+{
+  timer_.stop();
+  server_->applyChanges();
+  last_flush_.start();
+}
+
+}  // namespace annotate
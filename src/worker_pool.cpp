@@ -0,0 +1,102 @@
+#include <annotate/worker_pool.h>
+#include <algorithm>
+#include <atomic>
+
+using namespace std;
+
+namespace annotate
+{
+WorkerPool::WorkerPool(size_t threads)
+{
+  auto const count = threads ? threads : max(1u, thread::hardware_concurrency());
+  for (size_t i = 0; i < count; ++i)
+  {
+    threads_.emplace_back(&WorkerPool::run, this);
+  }
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    lock_guard<mutex> lock(mutex_);
+    stop_ = true;
+  }
+  condition_.notify_all();
+  for (auto& thread : threads_)
+  {
+    thread.join();
+  }
+}
+
+size_t WorkerPool::size() const
+{
+  return threads_.size();
+}
+
+void WorkerPool::parallelFor(size_t count, const function<void(size_t)>& task)
+{
+  if (count == 0)
+  {
+    return;
+  }
+
+  struct Progress
+  {
+    atomic<size_t> next{ 0u };
+    atomic<size_t> done{ 0u };
+    std::mutex lock;
+    condition_variable finished;
+  };
+  auto progress = make_shared<Progress>();
+  auto process = [progress, count, &task]() {
+    for (auto i = progress->next++; i < count; i = progress->next++)
+    {
+      task(i);
+      if (++progress->done == count)
+      {
+        lock_guard<mutex> lock(progress->lock);
+        progress->finished.notify_all();
+      }
+    }
+  };
+
+  auto const helpers = min(threads_.size(), count - 1);
+  for (size_t i = 0; i < helpers; ++i)
+  {
+    enqueue(process);
+  }
+  process();
+
+  unique_lock<mutex> lock(progress->lock);
+  progress->finished.wait(lock, [&progress, count]() { return progress->done == count; });
+}
+
+void WorkerPool::enqueue(function<void()> task)
+{
+  {
+    lock_guard<mutex> lock(mutex_);
+    tasks_.push_back(move(task));
+  }
+  condition_.notify_one();
+}
+
+void WorkerPool::run()
+{
+  for (;;)
+  {
+    function<void()> task;
+    {
+      unique_lock<mutex> lock(mutex_);
+      condition_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+      if (stop_ && tasks_.empty())
+      {
+        return;
+      }
+      task = move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+
+}  // namespace annotate
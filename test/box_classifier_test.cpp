@@ -0,0 +1,346 @@
+#include <annotate/box_classifier.h>
+#include <gtest/gtest.h>
+#include <tf/LinearMath/Vector3.h>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace annotate;
+using namespace std;
+
+namespace
+{
+struct Cloud
+{
+  vector<float> x;
+  vector<float> y;
+  vector<float> z;
+
+  void push(float px, float py, float pz)
+  {
+    x.push_back(px);
+    y.push_back(py);
+    z.push_back(pz);
+  }
+
+  size_t size() const
+  {
+    return x.size();
+  }
+};
+
+string name(ClassifierKernel kernel)
+{
+  switch (kernel)
+  {
+    case ClassifierKernel::Scalar:
+      return "Scalar";
+    case ClassifierKernel::Sse:
+      return "SSE";
+    case ClassifierKernel::Avx2:
+      return "AVX2";
+    case ClassifierKernel::Avx512:
+      return "AVX-512";
+  }
+  return "unknown";
+}
+
+/// Box with half sizes half_size around the origin of the box frame and a nearby area extended by margin
+BoxQuery boxQuery(const float transform[3][4], const double half_size[3], double margin, bool ignore_ground)
+{
+  BoxQuery query;
+  memcpy(query.transform, transform, sizeof(query.transform));
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    query.box_min[axis] = -half_size[axis];
+    query.box_max[axis] = half_size[axis];
+    query.nearby_min[axis] = -half_size[axis] - margin;
+    query.nearby_max[axis] = half_size[axis] + margin;
+  }
+  // Like analyzePoints(), points below the box do not count as nearby when ignoring the ground
+  if (ignore_ground)
+  {
+    query.nearby_min[2] = query.box_min[2];
+  }
+  return query;
+}
+
+/**
+ * Result of analyzePoints() before it used classifyPoints(): points transformed in float, classified by double
+ * precision tf::Vector3 comparisons
+ */
+struct Reference
+{
+  size_t inside{ 0u };
+  size_t nearby{ 0u };
+  tf::Vector3 minimum{ std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                       std::numeric_limits<float>::max() };
+  tf::Vector3 maximum{ std::numeric_limits<float>::min(), std::numeric_limits<float>::min(),
+                       std::numeric_limits<float>::min() };
+};
+
+Reference classifyReference(const BoxQuery& query, const Cloud& cloud)
+{
+  auto const& m = query.transform;
+  tf::Vector3 const box_min(query.box_min[0], query.box_min[1], query.box_min[2]);
+  tf::Vector3 const box_max(query.box_max[0], query.box_max[1], query.box_max[2]);
+  tf::Vector3 const nearby_min(query.nearby_min[0], query.nearby_min[1], query.nearby_min[2]);
+  tf::Vector3 const nearby_max(query.nearby_max[0], query.nearby_max[1], query.nearby_max[2]);
+  Reference result;
+  auto const* x = cloud.x.data();
+  auto const* y = cloud.y.data();
+  auto const* z = cloud.z.data();
+  for (size_t i = 0; i < cloud.size(); ++i)
+  {
+    tf::Vector3 const point(m[0][0] * x[i] + m[0][1] * y[i] + m[0][2] * z[i] + m[0][3],
+                            m[1][0] * x[i] + m[1][1] * y[i] + m[1][2] * z[i] + m[1][3],
+                            m[2][0] * x[i] + m[2][1] * y[i] + m[2][2] * z[i] + m[2][3]);
+    tf::Vector3 alien = point;
+    alien.setMax(nearby_min);
+    alien.setMin(nearby_max);
+    if (alien == point)
+    {
+      tf::Vector3 canary = point;
+      canary.setMax(box_min);
+      canary.setMin(box_max);
+      if (canary == point)
+      {
+        ++result.inside;
+        result.minimum.setMin(point);
+        result.maximum.setMax(point);
+      }
+      else
+      {
+        ++result.nearby;
+      }
+    }
+  }
+  return result;
+}
+
+/// Classify cloud with kernel and compare the result, combined like analyzePoints() does, to the reference
+void expectSameAsReference(ClassifierKernel kernel, const BoxQuery& query, const Cloud& cloud)
+{
+  auto const expected = classifyReference(query, cloud);
+  BoxClassification classification;
+  ASSERT_TRUE(classifyPoints(kernel, query, cloud.x.data(), cloud.y.data(), cloud.z.data(), cloud.size(),
+                             classification));
+  Reference actual;
+  actual.inside = classification.inside;
+  actual.nearby = classification.nearby;
+  if (classification.inside)
+  {
+    actual.minimum.setMin({ classification.minimum[0], classification.minimum[1], classification.minimum[2] });
+    actual.maximum.setMax({ classification.maximum[0], classification.maximum[1], classification.maximum[2] });
+  }
+  SCOPED_TRACE(name(kernel) + " kernel");
+  EXPECT_EQ(expected.inside, actual.inside);
+  EXPECT_EQ(expected.nearby, actual.nearby);
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    EXPECT_EQ(expected.minimum[axis], actual.minimum[axis]);
+    EXPECT_EQ(expected.maximum[axis], actual.maximum[axis]);
+  }
+}
+
+/// Classify the points [begin, end) of cloud with kernel and compare the result to the scalar fallback
+void expectSameAsScalar(ClassifierKernel kernel, const BoxQuery& query, const Cloud& cloud, size_t begin, size_t end)
+{
+  BoxClassification expected;
+  classifyPointsScalar(query, cloud.x.data() + begin, cloud.y.data() + begin, cloud.z.data() + begin, end - begin,
+                       expected);
+  BoxClassification actual;
+  ASSERT_TRUE(classifyPoints(kernel, query, cloud.x.data() + begin, cloud.y.data() + begin, cloud.z.data() + begin,
+                             end - begin, actual));
+  SCOPED_TRACE(name(kernel) + " kernel on points " + to_string(begin) + " to " + to_string(end));
+  EXPECT_EQ(expected.inside, actual.inside);
+  EXPECT_EQ(expected.nearby, actual.nearby);
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    EXPECT_EQ(expected.minimum[axis], actual.minimum[axis]);
+    EXPECT_EQ(expected.maximum[axis], actual.maximum[axis]);
+  }
+}
+
+}  // namespace
+
+TEST(BoxClassifier, ScalarKernelIsAvailable)
+{
+  auto const kernels = availableClassifierKernels();
+  ASSERT_FALSE(kernels.empty());
+  EXPECT_EQ(ClassifierKernel::Scalar, kernels.front());
+}
+
+TEST(BoxClassifier, KernelsMatchScalarOnRandomClouds)
+{
+  mt19937 random(42);
+  uniform_real_distribution<float> coordinate(-20.0f, 20.0f);
+  uniform_real_distribution<double> size(0.1, 6.0);
+  uniform_real_distribution<double> angle(-M_PI, M_PI);
+  uniform_real_distribution<float> offset(-3.0f, 3.0f);
+  for (int run = 0; run < 200; ++run)
+  {
+    // Most runs use clouds dense around the box to have many points inside and nearby
+    float const scale = run % 3 == 0 ? 1.0f : 0.2f;
+    Cloud cloud;
+    auto const points = random() % 2000;
+    for (size_t i = 0; i < points; ++i)
+    {
+      cloud.push(scale * coordinate(random), scale * coordinate(random), 0.1f * coordinate(random));
+    }
+
+    double const yaw = angle(random);
+    double const pitch = run % 4 == 0 ? 0.2 * angle(random) : 0.0;
+    float const transform[3][4] = {
+      { float(cos(yaw) * cos(pitch)), float(-sin(yaw)), float(cos(yaw) * sin(pitch)), offset(random) },
+      { float(sin(yaw) * cos(pitch)), float(cos(yaw)), float(sin(yaw) * sin(pitch)), offset(random) },
+      { float(-sin(pitch)), 0.0f, float(cos(pitch)), offset(random) }
+    };
+    double const half_size[3] = { 0.5 * size(random), 0.5 * size(random), 0.5 * size(random) };
+    auto const query = boxQuery(transform, half_size, 0.25, run % 2 == 1);
+    for (auto const kernel : availableClassifierKernels())
+    {
+      expectSameAsScalar(kernel, query, cloud, 0u, cloud.size());
+    }
+  }
+}
+
+TEST(BoxClassifier, KernelsMatchScalarOnFacesAndMargins)
+{
+  // With the identity transform, points end up exactly on the faces of the box and of the nearby area, and one float
+  // step inside or beyond them
+  float const transform[3][4] = { { 1.0f, 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f, 0.0f } };
+  double const half_size[3] = { 1.25, 0.75, 0.5 };
+  double const margin = 0.25;
+  Cloud cloud;
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    for (double const face : { -half_size[axis], half_size[axis] })
+    {
+      float const outward = face < 0.0 ? -1.0f : 1.0f;
+      for (double const distance : { 0.0, margin })
+      {
+        float const on_face = float(face + outward * distance);
+        float const beyond = nextafter(on_face, outward * INFINITY);
+        float const within = nextafter(on_face, -outward * INFINITY);
+        for (float const value : { on_face, beyond, within })
+        {
+          float p[3] = { 0.0f, 0.0f, 0.0f };
+          p[axis] = value;
+          cloud.push(p[0], p[1], p[2]);
+        }
+      }
+    }
+  }
+
+  for (bool const ignore_ground : { false, true })
+  {
+    auto const query = boxQuery(transform, half_size, margin, ignore_ground);
+    BoxClassification scalar;
+    classifyPointsScalar(query, cloud.x.data(), cloud.y.data(), cloud.z.data(), cloud.size(), scalar);
+    // Per face: on and within the box face are inside, beyond it and on and within the margin face are nearby.
+    // Below the bottom face, nothing is nearby when ignoring the ground.
+    EXPECT_EQ(2u * 6u, scalar.inside);
+    EXPECT_EQ(ignore_ground ? 3u * 5u : 3u * 6u, scalar.nearby);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      EXPECT_EQ(float(-half_size[axis]), scalar.minimum[axis]);
+      EXPECT_EQ(float(half_size[axis]), scalar.maximum[axis]);
+    }
+
+    for (auto const kernel : availableClassifierKernels())
+    {
+      expectSameAsScalar(kernel, query, cloud, 0u, cloud.size());
+    }
+  }
+}
+
+TEST(BoxClassifier, KernelsMatchScalarOnPartialVectors)
+{
+  // Ranges of the spatial index start anywhere and have any length, so the vector loops leave remainders
+  mt19937 random(7);
+  uniform_real_distribution<float> coordinate(-2.0f, 2.0f);
+  Cloud cloud;
+  for (size_t i = 0; i < 100; ++i)
+  {
+    cloud.push(coordinate(random), coordinate(random), coordinate(random));
+  }
+  float const transform[3][4] = { { 0.8f, -0.6f, 0.0f, 0.1f },
+                                  { 0.6f, 0.8f, 0.0f, -0.2f },
+                                  { 0.0f, 0.0f, 1.0f, 0.3f } };
+  double const half_size[3] = { 1.0, 0.5, 0.75 };
+  for (bool const ignore_ground : { false, true })
+  {
+    auto const query = boxQuery(transform, half_size, 0.25, ignore_ground);
+    for (auto const kernel : availableClassifierKernels())
+    {
+      for (size_t begin = 0; begin < 3; ++begin)
+      {
+        for (size_t count = 0; count <= 67; ++count)
+        {
+          expectSameAsScalar(kernel, query, cloud, begin, begin + count);
+        }
+      }
+    }
+  }
+}
+
+TEST(BoxClassifier, KernelsMatchDoublePrecisionClassification)
+{
+  mt19937 random(3);
+  uniform_real_distribution<float> coordinate(-4.0f, 4.0f);
+  uniform_real_distribution<double> size(0.1, 6.0);
+  uniform_real_distribution<double> angle(-M_PI, M_PI);
+  uniform_real_distribution<float> offset(-3.0f, 3.0f);
+  uniform_int_distribution<int> axis_of(0, 2);
+  uniform_int_distribution<int> step(-2, 2);
+  float const identity[3][4] = { { 1.0f, 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f, 0.0f } };
+  for (int run = 0; run < 200; ++run)
+  {
+    double const yaw = angle(random);
+    float const transform[3][4] = { { float(cos(yaw)), float(-sin(yaw)), 0.0f, offset(random) },
+                                    { float(sin(yaw)), float(cos(yaw)), 0.0f, offset(random) },
+                                    { 0.0f, 0.0f, 1.0f, offset(random) } };
+    double const half_size[3] = { 0.5 * size(random), 0.5 * size(random), 0.5 * size(random) };
+    bool const ignore_ground = run % 2 == 1;
+
+    Cloud cloud;
+    for (size_t i = 0; i < 1000; ++i)
+    {
+      cloud.push(coordinate(random), coordinate(random), coordinate(random));
+    }
+
+    // The bounds are hardly ever floats. Points on the floats closest to a bound on either side are classified
+    // depending on how the bounds are rounded. Without a transform, cloud coordinates are box frame coordinates.
+    auto const aligned = boxQuery(identity, half_size, 0.25, ignore_ground);
+    Cloud faces;
+    for (size_t i = 0; i < 200; ++i)
+    {
+      auto const axis = axis_of(random);
+      double const bounds[4] = { aligned.box_min[axis], aligned.box_max[axis], aligned.nearby_min[axis],
+                                 aligned.nearby_max[axis] };
+      auto value = float(bounds[i % 4]);
+      for (auto steps = step(random); steps != 0; steps += steps < 0 ? 1 : -1)
+      {
+        value = nextafter(value, steps < 0 ? -INFINITY : INFINITY);
+      }
+      float p[3] = { 0.0f, 0.0f, 0.0f };
+      p[axis] = value;
+      faces.push(p[0], p[1], p[2]);
+    }
+
+    for (auto const kernel : availableClassifierKernels())
+    {
+      expectSameAsReference(kernel, boxQuery(transform, half_size, 0.25, ignore_ground), cloud);
+      expectSameAsReference(kernel, aligned, faces);
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}